@@ -0,0 +1,100 @@
+//
+// Block allocator microbenchmark. For each disk usage level it fills a
+// fresh block_manager to that level, leaving the free blocks scattered
+// over the disk, then times single-block alloc/free pairs and runs of
+// contiguous blocks the size of a 32 KB write.
+//
+
+#include "inode_manager.h"
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "lang/verify.h"
+
+int nops = 100000;          // alloc/free pairs per level
+int run_len = 64;           // blocks per contiguous allocation
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Take every data block, then give back a random share of them, so
+// that the free ones are spread over the whole disk.
+static std::vector<blockid_t>
+fill(block_manager *bm, int pct)
+{
+  std::vector<blockid_t> all, kept;
+  blockid_t b;
+  while (bm->alloc_block(b))
+    all.push_back(b);
+  for (size_t i = 0; i < all.size(); i++) {
+    if (rand() % 100 < pct)
+      kept.push_back(all[i]);
+    else
+      bm->free_block(all[i]);
+  }
+  return kept;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int levels[] = { 10, 50, 95 };
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if (argc > 1)
+    nops = atoi(argv[1]);
+  if (argc > 2)
+    run_len = atoi(argv[2]);
+  if (nops < 1 || run_len < 1) {
+    fprintf(stderr, "Usage: %s [ops] [run-blocks]\n", argv[0]);
+    exit(1);
+  }
+
+  srand(1);
+  printf("%6s %14s %14s %12s\n", "usage", "alloc+free ns", "run alloc ns",
+         "avg run");
+  for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+    block_manager *bm = new block_manager();
+    std::vector<blockid_t> kept = fill(bm, levels[l]);
+
+    double start = now();
+    for (int i = 0; i < nops; i++) {
+      blockid_t b;
+      VERIFY(bm->alloc_block(b));
+      bm->free_block(b);
+    }
+    double single = (now() - start) / nops * 1e9;
+
+    // as a large write would: runs until run_len blocks are had,
+    // then all of them go back
+    int nruns = 0, nblocks = 0;
+    std::vector<blockid_t> got;
+    start = now();
+    for (int i = 0; i < nops / run_len + 1; i++) {
+      got.clear();
+      while ((int) got.size() < run_len) {
+        blockid_t s;
+        int n = bm->alloc_blocks(run_len - got.size(), s);
+        VERIFY(n > 0);
+        for (int k = 0; k < n; k++)
+          got.push_back(s + k);
+        nruns++;
+      }
+      nblocks += got.size();
+      for (size_t k = 0; k < got.size(); k++)
+        bm->free_block(got[k]);
+    }
+    double run = (now() - start) / nruns * 1e9;
+
+    printf("%5d%% %14.0f %14.0f %12.1f\n", levels[l], single, run,
+           (double) nblocks / nruns);
+    delete bm;
+  }
+}
@@ -6,9 +6,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <chrono>
 
 #include "chfs_client.h"
 #include "extent_client.h"
+#include "tlog.h"
 
 /* 
  * Your code here for Lab2A:
@@ -20,7 +22,8 @@
 chfs_client::chfs_client(std::string extent_dst, std::string lock_dst)
 {
     ec = new extent_client(extent_dst);
-    lc = new lock_client(lock_dst);
+    // ec caches inode attributes for as long as we hold the inode lock
+    lc = new lock_client_cache(lock_dst, ec);
     
     // 这行会使root dir清空（是每打开一个client就清空一次吗？那会不会不太合理？）
     // 为使log可用，将这行注释掉（虽然这样就无法检查root dir是否初始化成功了）
@@ -30,6 +33,13 @@ chfs_client::chfs_client(std::string extent_dst, std::string lock_dst)
 
 }
 
+// lc's renew thread calls back into ec for as long as the process
+// lives, so neither is freed; only what ec has yet to send goes out.
+chfs_client::~chfs_client()
+{
+    ec->flush();
+}
+
 chfs_client::inum
 chfs_client::n2i(std::string n)
 {
@@ -50,22 +60,22 @@ chfs_client::filename(inum inum)
 bool
 chfs_client::isfile(inum inum)
 {
-    // lc->acquire(inum);
+    lc->acquire_shared(inum);
     extent_protocol::attr a;
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
-        // lc->release(inum);
+        tlog_err("error getting attr\n");
+        lc->release(inum);
         return false;
     }
 
     if (a.type == extent_protocol::T_FILE) {
-        printf("isfile: %lld is a file\n", inum);
-        // lc->release(inum);
+        tlog_debug("isfile: %lld is a file\n", inum);
+        lc->release(inum);
         return true;
     } 
-    printf("isfile: %lld is a dir\n", inum);
-    // lc->release(inum);
+    tlog_debug("isfile: %lld is a dir\n", inum);
+    lc->release(inum);
     return false;
 }
 /** Your code here for Lab...
@@ -79,14 +89,14 @@ chfs_client::isdir(inum inum)
 {
     // Oops! is this still correct when you implement symlink?
     extent_protocol::attr a;
-    // lc->acquire(inum);
+    lc->acquire_shared(inum);
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
-        printf("error getting attr\n");
+        tlog_err("error getting attr\n");
         lc->release(inum);
         return false;
     }
-    // lc->release(inum);
+    lc->release(inum);
     return (a.type == extent_protocol::T_DIR);
 }
 
@@ -94,9 +104,9 @@ int
 chfs_client::getfile(inum inum, fileinfo &fin)
 {
     int r = OK;
-    // lc->acquire(inum);
+    lc->acquire_shared(inum);
 
-    printf("getfile %016llx\n", inum);
+    tlog_debug("getfile %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -107,10 +117,10 @@ chfs_client::getfile(inum inum, fileinfo &fin)
     fin.mtime = a.mtime;
     fin.ctime = a.ctime;
     fin.size = a.size;
-    printf("getfile %016llx -> sz %llu\n", inum, fin.size);
+    tlog_debug("getfile %016llx -> sz %llu\n", inum, fin.size);
 
 release:
-    // lc->release(inum);
+    lc->release(inum);
     return r;
 }
 
@@ -118,9 +128,9 @@ int
 chfs_client::getdir(inum inum, dirinfo &din)
 {
     int r = OK;
-    // lc->acquire(inum);
+    lc->acquire_shared(inum);
 
-    printf("getdir %016llx\n", inum);
+    tlog_debug("getdir %016llx\n", inum);
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) {
         r = IOERR;
@@ -131,14 +141,14 @@ chfs_client::getdir(inum inum, dirinfo &din)
     din.ctime = a.ctime;
 
 release:
-    // lc->release(inum);
+    lc->release(inum);
     return r;
 }
 
 
 #define EXT_RPC(xx) do { \
     if ((xx) != extent_protocol::OK) { \
-        printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
+        tlog_err("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
         r = IOERR; \
         goto release; \
     } \
@@ -151,32 +161,30 @@ chfs_client::setattr(inum ino, size_t size)
 {
     int r = OK;
 
-    
-    ec->begin_tx();
     lc->acquire(ino);
 
     std::string content;
     extent_protocol::attr a;
-    ec->getattr(ino, a);
+    if (ec->get(ino, content, a) != extent_protocol::OK) {
+        lc->release(ino);
+        return IOERR;
+    }
 
     if (size == a.size) {
         lc->release(ino);
         return r;
     }
     else if (size > a.size) {
-        ec->get(ino, content); 
         std::string extra_string(size - a.size, '\0');
         content.append(extra_string);
-        ec->put(ino, content);
     } else {
-        ec->get(ino, content);
         content = content.substr(0, size);
-        ec->put(ino, content);
     }
+    std::vector<extent_protocol::extentid_t> created;
+    if (ec->exec_tx({extent_protocol::tx_op::put(ino, content)}, created) !=
+        extent_protocol::OK)
+        r = IOERR;
     lc->release(ino);
-
-    ec->commit_tx();
-    ec->checkpoint();
     
     
     /*
@@ -194,8 +202,6 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
     int r = OK;
 
-    ec->begin_tx();
-
     // std::cout << "file name size: " <<  std::string(name).size() << std::endl;
 
     /*
@@ -206,33 +212,13 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 
     //没有考虑操作失败的情况
     // std::cout << parent << ' ' << std::string(name) << std::endl;
+    // the parent's lock is all it takes: the extent server allocates
+    // safely by itself, and nobody can name the new inode before its
+    // entry is in parent
     lc->acquire(parent);
-    // printf("create拿锁:%lld\n",parent);
 
-    //检查文件是否已经存在，如存在返回EXIST
-    bool is_exist = false; inum ino;
-    lookup(parent, name, is_exist, ino);
-    if (is_exist) {
-        lc->release(parent);
-        return EXIST;
-    }
-
-    // std::cout << parent << ' ' << std::string(name) << std::endl;
-    lc->acquire(0);
-    // printf("create拿锁:0\n");
-    //create操作不能并发进行，因为需要在bitblock中寻找为0的bit，并发会出问题
-
-    ec->create(extent_protocol::T_FILE, ino_out); //最好检查一下操作是否成功
-
-    std::string dir;
-    ec->get(parent, dir);
-
-    char dir_entry[ENTRY_SIZE] = {0};
-    strcpy(dir_entry, name);
-    *(inum *)(dir_entry + ENTRY_SIZE - 8) = ino_out;
-
-    dir.append(dir_entry, ENTRY_SIZE);
-    ec->put(parent, dir);
+    //文件已经存在时add_entry返回EXIST
+    r = add_entry(parent, name, extent_protocol::T_FILE, "", ino_out);
     // std::cout << dir << std::endl;
 
     // std::cout << "new ino: " << ino_out << std::endl;
@@ -242,10 +228,6 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
     // }
     // std::cout << std::endl;
     lc->release(parent);
-    lc->release(0);
-
-    ec->commit_tx();
-    ec->checkpoint();
 
     return r;
 }
@@ -255,49 +237,79 @@ int
 chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
     int r = OK;
-    ec->begin_tx();
 
     /*
      * your code goes here.
      * note: lookup is what you need to check if directory exist;
      * after create file or dir, you must remember to modify the parent infomation.
      */
+    // as in create
     lc->acquire(parent);
-    // printf("create拿锁:%lld\n",parent);
-
-    bool found;
-    lookup(parent, name, found, ino_out);
-    if (found) {
-        r = EXIST;
-        lc->release(parent);
-        return r;
-    }
-    lc->acquire(0);
-    // printf("create拿锁:0\n");
-    ec->create(extent_protocol::T_DIR, ino_out); 
+    r = add_entry(parent, name, extent_protocol::T_DIR, "", ino_out);
+    lc->release(parent);
 
-    std::string dir;
-    ec->get(parent, dir);
 
-    char dir_entry[ENTRY_SIZE] = {0};
-    strcpy(dir_entry, name);
-    *(inum *)(dir_entry + ENTRY_SIZE - 8) = ino_out;
+    return r;
+}
 
-    dir.append(dir_entry, ENTRY_SIZE);
-    ec->put(parent, dir);
+// Make an inode of type with contents data and enter it in parent as
+// name, which fails with EXIST if parent has name already. The caller
+// holds parent's lock. When the inode lives on parent's shard this is
+// one transaction, and the extent server applies it whole or not at
+// all.
+//
+// A directory may belong on another extent shard than its parent. Then
+// it takes two transactions, which are not atomic together: the inode
+// is made first and entered second, so a crash in between leaves at
+// worst an inode nothing names, never an entry naming nothing; if
+// entering it fails, the inode is taken back.
+int
+chfs_client::add_entry(inum parent, const char *name, uint32_t type,
+                       const std::string &data, inum &ino_out)
+{
+    int home = ec->shard_of(parent);
+    int where = ec->place(parent, name, type);
+
+    std::vector<extent_protocol::tx_op> tx;
+    tx.push_back(extent_protocol::tx_op::create(type));
+    if (!data.empty())
+        tx.push_back(extent_protocol::tx_op::put(extent_protocol::new_inum(0), data));
+    std::vector<extent_protocol::extentid_t> created;
+    int ret;
+    if (where == home) {
+        tx.push_back(extent_protocol::tx_op::dir_add(parent, name,
+                                                     extent_protocol::new_inum(0)));
+        ret = ec->exec_tx(tx, created, home);
+    } else {
+        ret = ec->exec_tx(tx, created, where);
+        if (ret == extent_protocol::OK && !created.empty()) {
+            std::vector<extent_protocol::extentid_t> none;
+            ret = ec->exec_tx({extent_protocol::tx_op::dir_add(parent, name, created[0])},
+                              none, home);
+            if (ret != extent_protocol::OK)
+                ec->exec_tx({extent_protocol::tx_op::remove(created[0])}, none, where);
+        }
+    }
+    if (ret == extent_protocol::EXIST)
+        return EXIST;
+    if (ret != extent_protocol::OK || created.empty())
+        return IOERR;
+    ino_out = created[0];
+    return OK;
+}
 
+int
+chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+{
+    lc->acquire_shared(parent);
+    int r = lookup_wo(parent, name, found, ino_out);
     lc->release(parent);
-    lc->release(0);
-
-    ec->commit_tx();
-    ec->checkpoint();
-
-
     return r;
 }
 
+// Like lookup, for callers that already hold the lock on parent.
 int
-chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
+chfs_client::lookup_wo(inum parent, const char *name, bool &found, inum &ino_out)
 {
     int r = OK;
 
@@ -307,24 +319,10 @@ chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
      * you should design the format of directory content.
      */
     // lc->acquire(parent);
-    std::string dir;
-    ec->get(parent, dir);
-    std::string filename(name);
-    // std::cout << "look up filename: " << name << std::endl;
-
-    found = false;
-
-    for (int i = 0; i < dir.size(); i += ENTRY_SIZE) {
-        // std::cout << dir.substr(i, filename.size()) << std::endl;
-        // std::cout << std::string(filename).substr(0, ENTRY_SIZE - 8) << std::endl;
-        if (dir.compare(i, filename.size(), filename) == 0 && dir[i + filename.size()] == '\0') {
-            found = true;
-            ino_out = *(inum *)(dir.c_str() + i + ENTRY_SIZE - 8);
-            // std::cout << "found ino: " << ino_out << std::endl;
-            // std::cout << dir.substr(i, filename.size()) << std::endl;
-            break;
-        }
-    }
+    extent_protocol::extentid_t ino;
+    found = ec->dir_lookup(parent, name, ino) == extent_protocol::OK;
+    if (found)
+        ino_out = ino;
     // lc->release(parent);
     // std::cout << found << std::endl;
 
@@ -341,20 +339,27 @@ chfs_client::readdir(inum dir, std::list<dirent> &list)
      * note: you should parse the dirctory content using your defined format,
      * and push the dirents to the list.
      */
-    // lc->acquire(dir);
-    std::string dir_list;
-    ec->get(dir, dir_list);
+    // The entries come with their attributes in one RPC. Those of
+    // entries whose lock this client has held throughout are still
+    // what the server has, so they go into ec's cache, and the getattr
+    // that ls -l sends next for each entry needs no RPC.
+    lc->acquire_shared(dir);
+    unsigned long long mark = lc->mark();
+    unsigned long long gen = ec->generation();
+    std::vector<extent_protocol::dirent> ents;
+    if (ec->readdirplus(dir, ents) != extent_protocol::OK)
+        r = IOERR;
 
-    for (int i = 0; i < dir_list.size(); i += ENTRY_SIZE) {
-        std::string filename(dir_list.c_str() + i);
-        // std::cout << filename << std::endl;
+    for (size_t i = 0; i < ents.size(); i++) {
         dirent dir_entry;
-        dir_entry.name = filename;
-        dir_entry.inum = *(inum *)(dir_list.c_str() + i + ENTRY_SIZE - 8);
-        // std::cout << dir_entry.name << ' ' << dir_entry.inum << std::endl;
+        dir_entry.name = ents[i].name;
+        dir_entry.inum = ents[i].inum;
+        dir_entry.type = ents[i].a.type;
         list.push_back(dir_entry);
+        if (ents[i].a.type != 0 && lc->held_since(ents[i].inum, mark))
+            ec->seed(ents[i].inum, ents[i].a, gen);
     }
-    // lc->release(dir);
+    lc->release(dir);
 
     return r;
 }
@@ -363,29 +368,13 @@ int
 chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
-    // lc->acquire(ino);
-
-    std::string content;
-    extent_protocol::attr a;
-    ec->getattr(ino, a);
-
-    if (off >= a.size) {
-        data = "";
-        return r;
-    } else {
-        ec->get(ino, content);
-        if (off + size <= a.size) {
-            data = content.substr(off, size);
-        } else {
-            data = content.substr(off, a.size - off);
-        }
-    }
-    // lc->release(ino);
+    // Writers hold the inode lock EXCLUSIVE, so holding it SHARED keeps
+    // them out for as long as we read.
+    lc->acquire_shared(ino);
 
-    /*
-     * your code goes here.
-     * note: read using ec->get().
-     */
+    // comes back short past the end of the file
+    ec->read_range(ino, off, size, data);
+    lc->release(ino);
 
     return r;
 }
@@ -399,98 +388,115 @@ chfs_client::write(inum ino, size_t size, off_t off, const char *data,
 
     int r = OK;
 
-    ec->begin_tx();
-
-    std::string content;
-    extent_protocol::attr a;
-
+    // Every write takes the inode lock EXCLUSIVE: even one inside the
+    // file changes the mtime other clients may have cached, and taking
+    // the lock from them is what makes them drop it. The server fills
+    // any hole before off with zeros.
+    // While we hold the lock nobody else can see the file, so the write
+    // need not wait for the server: ec sends it behind the ones before
+    // it and has them all answered before the lock goes back. A stream
+    // of writes from one client costs one RPC each and no lock traffic.
+    // If one of them fails, the next write to the file, or the next
+    // fsync or close, reports the error.
     lc->acquire(ino);
-    ec->getattr(ino, a);
-
-    if (off > a.size) {
-        setattr(ino, off);
-    }
-    ec->get(ino, content);
-    // std::cout << "content: " << content << std::endl;
-    // std::cout << "write data: " << std::string(data, size) << std::endl;
-
-    if (off + size < a.size) {
-        content = content.substr(0, off) 
-            + std::string(data, size) 
-            + content.substr(off + size, a.size - off - size);
-    } else {
-        content = content.substr(0, off)
-            + std::string(data, size);
-    }
-    ec->put(ino, content);
-    bytes_written = size;
-    /*
-     * your code goes here.
-     * note: write using ec->put().
-     * when off > length of original file, fill the holes with '\0'.
-     */
+    extent_client::future f =
+        ec->write_range_async(ino, off, std::string(data, size));
+    int ret = extent_protocol::OK;
+    if (f.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        ret = f.get();
+    if (ret == extent_protocol::OK)
+        bytes_written = size;
+    else
+        r = IOERR;
     lc->release(ino);
 
-    ec->commit_tx();
-    ec->checkpoint();
-
-
     return r;
 }
 
+// Wait for this client's writes to ino to reach the server, and report
+// the first of them to fail since the last fsync.
+int
+chfs_client::fsync(inum ino)
+{
+    if (ec->flush(ino) != extent_protocol::OK)
+        return IOERR;
+    return OK;
+}
+
 // Your code here for Lab2A: add logging to ensure atomicity
 int chfs_client::unlink(inum parent,const char *name)
 {
     int r = OK;
-    ec->begin_tx();
 
     // //检查是否有该文件
     bool found;
     inum ino;
 
+    // Take the locks of parent and ino, in id order. Taking ino's makes
+    // other clients drop what they cache about it before it goes. ino
+    // is only known once parent is held, so a child numbered below its
+    // parent means letting parent go, taking both, and looking again.
     lc->acquire(parent);
-    lookup(parent, name, found, ino);
+    lookup_wo(parent, name, found, ino);
+    bool have_ino = false;
+    while (found && ino < parent) {
+        lc->release(parent);
+        lc->acquire_many({ino, parent});
+        inum again;
+        lookup_wo(parent, name, found, again);
+        if (found && again == ino) {
+            have_ino = true;
+            break;
+        }
+        lc->release(ino);
+        ino = again;
+    }
     if (!found) {
-        r = NOENT;
         lc->release(parent);
-        return r;
+        return NOENT;
     }
+    if (!have_ino)
+        lc->acquire(ino);
     //检查该文件是否为目录
     extent_protocol::attr a;
-    ec->getattr(ino, a);
+    if (ec->getattr(ino, a) != extent_protocol::OK) {
+        r = IOERR;
+        lc->release_many({parent, ino});
+        return r;
+    }
     if (a.type == extent_protocol::T_DIR) {
         r = NOTEMPTY;
-        lc->release(parent);
+        lc->release_many({parent, ino});
         return r;
     }
 
 
-    //在目录中删除entry
-    std::string dir;
-    ec->get(parent, dir);
-
-    // std::string filename(name);
-    // filename.push_back('\0');  //为避免-2与-20混淆
-    size_t entry_pos = dir.find(name);
-    dir.erase(entry_pos, ENTRY_SIZE);
-
-    ec->put(parent, dir);
-
-    lc->acquire(0);
-    //删除文件
-    ec->remove(ino);
+    //在目录中删除entry, 删除文件
+    // one transaction on a single shard; across shards two, the entry
+    // going first, so a crash between them leaves at worst an inode
+    // nothing names, as in add_entry
+    std::vector<extent_protocol::extentid_t> created;
+    int ret;
+    if (ec->shard_of(ino) == ec->shard_of(parent)) {
+        ret = ec->exec_tx({extent_protocol::tx_op::dir_remove(parent, name),
+                           extent_protocol::tx_op::remove(ino)}, created);
+    } else {
+        ret = ec->exec_tx({extent_protocol::tx_op::dir_remove(parent, name)},
+                          created);
+        if (ret == extent_protocol::OK)
+            ret = ec->exec_tx({extent_protocol::tx_op::remove(ino)}, created);
+    }
+    if (ret == extent_protocol::NOENT)
+        r = NOENT;
+    else if (ret != extent_protocol::OK)
+        r = IOERR;
 
     /*
      * your code goes here.
      * note: you should remove the file using ec->remove,
      * and update the parent directory content.
      */
-    lc->release(parent);
-    lc->release(0);
-
-    ec->commit_tx();
-    ec->checkpoint();
-    
+    lc->release_many({parent, ino});
 
     return r;
 }
@@ -498,7 +504,6 @@ int chfs_client::unlink(inum parent,const char *name)
 int chfs_client::symlink(const char *link, inum parent, const char * name, inum &ino)
 {
     int r = OK;
-    ec->begin_tx();
 
     // bool found;
     // lookup(parent, name, found, ino_out);
@@ -506,28 +511,10 @@ int chfs_client::symlink(const char *link, inum parent, const char * name, inum
     //     r = EXIST;
     //     return r;
     // }
+    // as in create
     lc->acquire(parent);
-    lc->acquire(0);
-
-    ec->create(extent_protocol::T_LINK, ino); 
-    ec->put(ino, std::string(link));
-
-    std::string dir;
-    ec->get(parent, dir);
-
-    char dir_entry[ENTRY_SIZE] = {0};
-    strcpy(dir_entry, name);
-    *(inum *)(dir_entry + ENTRY_SIZE - 8) = ino;
-
-    dir.append(dir_entry, ENTRY_SIZE);
-    ec->put(parent, dir);
-
+    r = add_entry(parent, name, extent_protocol::T_LINK, link, ino);
     lc->release(parent);
-    lc->release(0);
-
-    ec->commit_tx();
-    ec->checkpoint();
-    
 
     return r;
 
@@ -535,9 +522,10 @@ int chfs_client::symlink(const char *link, inum parent, const char * name, inum
 
 int chfs_client::readlink(inum ino, std::string &link)
 {
-    // lc->acquire(ino);
+    lc->acquire_shared(ino);
     ec->get(ino, link);
-    // lc->release(ino);
+    lc->release(ino);
+    return OK;
 }
 
 //lookup需要显式调用吗？ fuse会自己处理吧？
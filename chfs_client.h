@@ -4,15 +4,14 @@
 #include <string>
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_client_cache.h"
 #include "extent_client.h"
 #include <vector>
 
-#define ENTRY_SIZE 68
-
 
 class chfs_client {
   extent_client *ec;
-  lock_client *lc;
+  lock_client_cache *lc;
  public:
 
   typedef unsigned long long inum;
@@ -33,16 +32,20 @@ class chfs_client {
   struct dirent {
     std::string name;
     chfs_client::inum inum;
+    uint32_t type;   // extent_protocol::T_*, or 0 if not known
   };
 
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+  int lookup_wo(inum, const char *, bool &, inum &);
+  int add_entry(inum, const char *, uint32_t, const std::string &, inum &);
 
   unsigned long long txid = 1;
 
  public:
   chfs_client(std::string, std::string);
+  ~chfs_client();
 
   bool isfile(inum);
   bool isdir(inum);
@@ -55,6 +58,7 @@ class chfs_client {
   int create(inum, const char *, mode_t, inum &);
   int readdir(inum, std::list<dirent> &);
   int write(inum, size_t, off_t, const char *, size_t &);
+  int fsync(inum);
   int read(inum, size_t, off_t, std::string &);
   int unlink(inum,const char *);
   int mkdir(inum , const char *, mode_t , inum &);
@@ -0,0 +1,216 @@
+//
+// Client tester: runs two extent server shards and a lock server in
+// this process, on rpc ports, with two chfs_clients against them, and
+// counts the reads the servers are asked for.
+//
+
+#include "chfs_client.h"
+#include "extent_server.h"
+#include "lock_server_cache.h"
+#include "rpc.h"
+#include "lang/verify.h"
+#include <atomic>
+#include <fstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef extent_protocol P;
+
+enum { NSHARD = 2 };
+
+// reads of inode contents or attributes, over all shards
+std::atomic<int> nreads;
+
+class counting_server : public extent_server {
+ public:
+  counting_server(int shard, int nshards) : extent_server(shard, nshards) {}
+  int get(P::extentid_t id, std::string &buf) {
+    nreads++;
+    return extent_server::get(id, buf);
+  }
+  int getattr(P::extentid_t id, P::attr &a) {
+    nreads++;
+    return extent_server::getattr(id, a);
+  }
+  int get_with_attr(P::extentid_t id, P::attr_data &r) {
+    nreads++;
+    return extent_server::get_with_attr(id, r);
+  }
+};
+
+chfs_client *c1, *c2;
+
+void
+fail(const char *what)
+{
+  fprintf(stderr, "error: %s\n", what);
+  fprintf(stdout, "error: %s\n", what);
+  exit(1);
+}
+
+void
+start_servers()
+{
+  int port = 20000 + (getpid() % 10000) * 4;
+  std::ofstream cfg("extents");
+  for (int s = 0; s < NSHARD; s++) {
+    counting_server *es = new counting_server(s, NSHARD);
+    rpcs *server = new rpcs(port + s);
+    server->reg(P::get, es, &counting_server::get);
+    server->reg(P::getattr, es, &counting_server::getattr);
+    server->reg(P::get_with_attr, es, &counting_server::get_with_attr);
+    server->reg(P::put, (extent_server *) es, &extent_server::put);
+    server->reg(P::read_range, (extent_server *) es, &extent_server::read_range);
+    server->reg(P::write_range, (extent_server *) es, &extent_server::write_range);
+    server->reg(P::readdirplus, (extent_server *) es, &extent_server::readdirplus);
+    server->reg(P::exec_tx, (extent_server *) es, &extent_server::exec_tx);
+    server->reg(P::dir_lookup, (extent_server *) es, &extent_server::dir_lookup);
+    server->reg(P::dir_add, (extent_server *) es, &extent_server::dir_add);
+    server->reg(P::dir_remove, (extent_server *) es, &extent_server::dir_remove);
+    server->reg(P::dir_list, (extent_server *) es, &extent_server::dir_list);
+    server->reg(P::remove, (extent_server *) es, &extent_server::remove);
+    server->reg(P::create, (extent_server *) es, &extent_server::create);
+    server->reg(P::begin_tx, (extent_server *) es, &extent_server::begin_tx);
+    server->reg(P::commit_tx, (extent_server *) es, &extent_server::commit_tx);
+    server->reg(P::checkpoint, (extent_server *) es, &extent_server::checkpoint);
+    cfg << "127.0.0.1:" << port + s << "\n";
+  }
+  cfg.close();
+
+  lock_server_cache *ls = new lock_server_cache();
+  rpcs *server = new rpcs(port + NSHARD);
+  server->reg(lock_protocol::stat, ls, &lock_server_cache::stat);
+  server->reg(lock_protocol::acquire, ls, &lock_server_cache::acquire);
+  server->reg(lock_protocol::acquire_shared, ls, &lock_server_cache::acquire_shared);
+  server->reg(lock_protocol::acquire_many, ls, &lock_server_cache::acquire_many);
+  server->reg(lock_protocol::release, ls, &lock_server_cache::release);
+  server->reg(lock_protocol::downgrade, ls, &lock_server_cache::downgrade);
+  server->reg(lock_protocol::renew, ls, &lock_server_cache::renew);
+  server->reg(lock_protocol::stat_top, ls, &lock_server_cache::stat_top);
+  server->reg(lock_protocol::acquire_range, ls, &lock_server_cache::acquire_range);
+  server->reg(lock_protocol::release_range, ls, &lock_server_cache::release_range);
+
+  std::string lock_dst = "127.0.0.1:" + std::to_string(port + NSHARD);
+  c1 = new chfs_client("extents", lock_dst);
+  c2 = new chfs_client("extents", lock_dst);
+}
+
+// test1: while a client holds a file's lock, repeated stats of it cost
+// at most one read; once another client writes the file, the first
+// sees the new size.
+void
+test1(void)
+{
+  printf("test1: attributes are cached under the inode lock\n");
+  chfs_client::inum f;
+  size_t n;
+  std::string buf(200, 'a');
+  if (c1->create(1, "cached", 0644, f) != chfs_client::OK ||
+      c1->write(f, 100, 0, buf.data(), n) != chfs_client::OK ||
+      c1->fsync(f) != chfs_client::OK)
+    fail("creating the file");
+
+  int before = nreads;
+  for (int i = 0; i < 10; i++) {
+    chfs_client::fileinfo fi;
+    if (!c1->isfile(f) || c1->isdir(f) ||
+        c1->getfile(f, fi) != chfs_client::OK || fi.size != 100)
+      fail("stat of the file");
+  }
+  printf("test1: 10 stats took %d reads\n", nreads - before);
+  if (nreads - before > 1)
+    fail("repeated stats went to the server");
+
+  if (c2->write(f, 200, 0, buf.data(), n) != chfs_client::OK ||
+      c2->fsync(f) != chfs_client::OK)
+    fail("writing the file from the other client");
+  chfs_client::fileinfo fi;
+  if (c1->getfile(f, fi) != chfs_client::OK || fi.size != 200)
+    fail("a stale size survived another client's write");
+  printf("test1: passed\n");
+}
+
+// test2: directories spread over the shards, and a file goes on its
+// directory's shard. A directory entered in a parent on another shard
+// is still found, and read back, by the other client.
+void
+test2(void)
+{
+  printf("test2: inodes are spread over %d shards\n", NSHARD);
+  int on[NSHARD] = {0};
+  for (int i = 0; i < 10; i++) {
+    std::string name = "d" + std::to_string(i);
+    chfs_client::inum d, f;
+    size_t n;
+    if (c1->mkdir(1, name.c_str(), 0755, d) != chfs_client::OK)
+      fail("mkdir");
+    if (c1->mkdir(1, name.c_str(), 0755, f) != chfs_client::EXIST)
+      fail("a second mkdir of the same name");
+    on[(d - 1) % NSHARD]++;
+    if (c1->create(d, "file", 0644, f) != chfs_client::OK ||
+        c1->write(f, name.size(), 0, name.data(), n) != chfs_client::OK ||
+        c1->fsync(f) != chfs_client::OK)
+      fail("creating a file in the directory");
+    if ((f - 1) % NSHARD != (d - 1) % NSHARD)
+      fail("a file went to another shard than its directory");
+  }
+  printf("test2: directories per shard:");
+  for (int s = 0; s < NSHARD; s++)
+    printf(" %d", on[s]);
+  printf("\n");
+  for (int s = 0; s < NSHARD; s++)
+    if (on[s] == 0)
+      fail("a shard got no directories");
+
+  for (int i = 0; i < 10; i++) {
+    std::string name = "d" + std::to_string(i), data;
+    bool found;
+    chfs_client::inum d, f;
+    if (c2->lookup(1, name.c_str(), found, d) != chfs_client::OK || !found ||
+        !c2->isdir(d))
+      fail("the other client cannot find a directory");
+    if (c2->lookup(d, "file", found, f) != chfs_client::OK || !found ||
+        c2->read(f, 100, 0, data) != chfs_client::OK || data != name)
+      fail("the other client cannot read a file");
+  }
+  printf("test2: passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int test = 0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [test]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 1) {
+    test = atoi(argv[1]);
+    if (test < 1 || test > 2) {
+      printf("Test number must be between 1 and 2\n");
+      exit(1);
+    }
+  }
+
+  // the servers keep their logs in ./log; use a scratch directory
+  char dir[] = "/tmp/chfs_tester.XXXXXX";
+  VERIFY(mkdtemp(dir) != NULL);
+  VERIFY(chdir(dir) == 0);
+  VERIFY(mkdir("log", 0777) == 0);
+  start_servers();
+
+  if (!test || test == 1)
+    test1();
+  if (!test || test == 2)
+    test2();
+
+  printf("%s: passed all tests successfully\n", argv[0]);
+  exit(0);
+}
@@ -6,15 +6,62 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include "server_list.h"
+#include "tlog.h"
 
 extent_client::extent_client(std::string dst)
+  : next_seq(0), changes(0), stopping(false)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0) {
-    printf("extent_client: bind failed\n");
+  std::vector<std::string> servers = parse_server_list(dst);
+  for (size_t i = 0; i < servers.size(); i++) {
+    sockaddr_in dstsock;
+    make_sockaddr(servers[i].c_str(), &dstsock);
+    rpcc *c = new rpcc(dstsock);
+    if (c->bind() != 0) {
+      printf("extent_client: bind %s failed\n", servers[i].c_str());
+    }
+    cls.push_back(c);
   }
+  cl = cls[0];
+  for (int i = 0; i < NSENDER; i++)
+    senders.push_back(std::thread(&extent_client::sender_loop, this));
+}
+
+extent_client::~extent_client()
+{
+  flush();
+  {
+    std::lock_guard<std::mutex> l(m);
+    stopping = true;
+  }
+  jobs_cv.notify_all();
+  for (size_t i = 0; i < senders.size(); i++)
+    senders[i].join();
+}
+
+int
+extent_client::shard_of(extent_protocol::extentid_t eid) const
+{
+  return (int) ((eid - 1) % cls.size());
+}
+
+// Files and symlinks go on their parent's shard, so making one and
+// entering it in the parent is one transaction on one server.
+// Directories are spread over the shards by hash, so the tree does not
+// all end up on shard 0.
+int
+extent_client::place(extent_protocol::extentid_t parent, const std::string &name,
+                     uint32_t type) const
+{
+  if (type != extent_protocol::T_DIR || cls.size() == 1)
+    return shard_of(parent);
+  uint64_t h = std::hash<std::string>()(name) ^ (parent * 0x9e3779b97f4a7c15ULL);
+  return (int) (h % cls.size());
 }
 
 extent_protocol::status
@@ -31,11 +78,48 @@ extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
+  extent_protocol::attr a;
+  return get(eid, buf, a);
+}
+
+// Contents and attributes in one round trip. A directory's contents are
+// kept along with its attributes.
+extent_protocol::status
+extent_client::get(extent_protocol::extentid_t eid, std::string &buf,
+                   extent_protocol::attr &a)
+{
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<extent_protocol::extentid_t, cached>::iterator it =
+      cache.find(eid);
+    if (it != cache.end() && it->second.has_data) {
+      buf = it->second.data;
+      a = it->second.a;
+      return extent_protocol::OK;
+    }
+  }
+
+  wait_pending(eid);
+  extent_protocol::attr_data r;
   extent_protocol::status ret = 
-    cl->call(extent_protocol::get, eid, buf);
+    server(eid)->call(extent_protocol::get_with_attr, eid, r);
 
   // std::cout << "get ret: " << ret << std::endl;
 
+  if (ret == extent_protocol::OK) {
+    buf = r.data;
+    a = r.a;
+    // a free inode (type 0) may be handed out by a create we hear
+    // nothing about, so only live ones are kept
+    if (a.type != 0) {
+      std::lock_guard<std::mutex> l(m);
+      cached &c = cache[eid];
+      c.a = a;
+      c.has_data = a.type == extent_protocol::T_DIR;
+      c.data = c.has_data ? buf : std::string();
+    }
+  }
+
   return ret;
 }
 
@@ -43,38 +127,293 @@ extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid, 
 		       extent_protocol::attr &attr)
 {
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<extent_protocol::extentid_t, cached>::iterator it =
+      cache.find(eid);
+    if (it != cache.end()) {
+      attr = it->second.a;
+      return extent_protocol::OK;
+    }
+  }
+
+  wait_pending(eid);
   extent_protocol::status ret = 
-    cl->call(extent_protocol::getattr, eid, attr);
+    server(eid)->call(extent_protocol::getattr, eid, attr);
 
   // std::cout << "getattr ret: " << ret << std::endl;
 
+  if (ret == extent_protocol::OK && attr.type != 0) {
+    std::lock_guard<std::mutex> l(m);
+    cache[eid].a = attr;
+  }
+
+  return ret;
+}
+
+// The entries of directory eid with their attributes, in one RPC. The
+// caller must hold eid's lock. It holds none on the entries as such, so
+// their attributes are only kept if the caller seeds them.
+extent_protocol::status
+extent_client::readdirplus(extent_protocol::extentid_t eid,
+                           std::vector<extent_protocol::dirent> &ents)
+{
+  wait_pending(eid);
+  return server(eid)->call(extent_protocol::readdirplus, eid, ents);
+}
+
+unsigned long long
+extent_client::generation()
+{
+  std::lock_guard<std::mutex> l(m);
+  return changes;
+}
+
+// a, fetched after generation() returned gen, is still what the server
+// has unless a change this client made, or the loss of a lock, came in
+// between; and then changes has moved on.
+void
+extent_client::seed(extent_protocol::extentid_t eid,
+                    const extent_protocol::attr &a, unsigned long long gen)
+{
+  std::lock_guard<std::mutex> l(m);
+  if (changes != gen || a.type == 0 || cache.count(eid) || pend.count(eid))
+    return;
+  cached &c = cache[eid];
+  c.a = a;
+  c.has_data = false;
+}
+
+// Only what is already cached is updated: its presence means we still
+// hold the inode lock.
+void
+extent_client::refresh(extent_protocol::extentid_t eid,
+                       const extent_protocol::attr &a, const std::string *data)
+{
+  std::lock_guard<std::mutex> l(m);
+  changes++;
+  std::map<extent_protocol::extentid_t, cached>::iterator it =
+    cache.find(eid);
+  if (it == cache.end())
+    return;
+  it->second.a = a;
+  if (it->second.has_data && data)
+    it->second.data = *data;
+  else
+    it->second.has_data = false;
+}
+
+// A failed async call stays in pend for the next flush or write on lid
+// to report, lock or no lock.
+void
+extent_client::dorelease(lock_protocol::lockid_t lid)
+{
+  wait_pending(lid);
+  std::lock_guard<std::mutex> l(m);
+  changes++;
+  cache.erase(lid);
+  names.erase(lid);
+}
+
+// Called with the lock client's mutex held: drop what we have on lid
+// and keep its queued mutations from being sent, without waiting.
+void
+extent_client::dolapse(lock_protocol::lockid_t lid)
+{
+  std::lock_guard<std::mutex> l(m);
+  changes++;
+  cache.erase(lid);
+  names.erase(lid);
+  std::map<extent_protocol::extentid_t, pending>::iterator it = pend.find(lid);
+  if (it != pend.end())
+    it->second.drop_below = next_seq;
+}
+
+// The inum name has in directory dir, or NOENT. The caller must hold
+// dir's lock. Answered from what is cached when it can be; otherwise
+// only the name and inum cross the wire.
+extent_protocol::status
+extent_client::dir_lookup(extent_protocol::extentid_t dir,
+                          const std::string &name,
+                          extent_protocol::extentid_t &ino)
+{
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<extent_protocol::extentid_t, cached>::iterator it = cache.find(dir);
+    if (it != cache.end() && it->second.has_data) {
+      size_t pos = extent_protocol::dir_find(it->second.data, name);
+      if (pos == std::string::npos)
+        return extent_protocol::NOENT;
+      ino = extent_protocol::dir_inum(it->second.data, pos);
+      return extent_protocol::OK;
+    }
+    std::map<extent_protocol::extentid_t,
+             std::map<std::string, extent_protocol::extentid_t> >::iterator n =
+      names.find(dir);
+    if (n != names.end() && n->second.count(name)) {
+      ino = n->second[name];
+      return extent_protocol::OK;
+    }
+  }
+
+  wait_pending(dir);
+  extent_protocol::status ret =
+    server(dir)->call(extent_protocol::dir_lookup, dir, name, ino);
+  if (ret == extent_protocol::OK) {
+    std::lock_guard<std::mutex> l(m);
+    names[dir][name] = ino;
+  }
   return ret;
 }
 
+// The entries of directory dir. The caller must hold dir's lock.
+extent_protocol::status
+extent_client::dir_list(extent_protocol::extentid_t dir,
+                        std::vector<extent_protocol::dentry> &ents)
+{
+  wait_pending(dir);
+  return server(dir)->call(extent_protocol::dir_list, dir, ents);
+}
+
 extent_protocol::status
 extent_client::put(extent_protocol::extentid_t eid, std::string buf, bool iflog)
 { 
-  int r;
+  wait_pending(eid);
+  extent_protocol::attr a;
   extent_protocol::status ret = 
-    cl->call(extent_protocol::put, eid, buf, iflog, r);
+    server(eid)->call(extent_protocol::put, eid, buf, iflog, a);
+  if (ret == extent_protocol::OK)
+    refresh(eid, a, &buf);
 
   // std::cout << "put ret: " << ret << std::endl;
 
   return ret;
 }
 
+// Only the bytes asked for cross the wire; a read past the end of the
+// file comes back short.
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid,
+                          unsigned long long off, unsigned long long len,
+                          std::string &buf)
+{
+  wait_pending(eid);
+  extent_protocol::status ret =
+    server(eid)->call(extent_protocol::read_range, eid, off, len, buf);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid,
+                           unsigned long long off, std::string buf)
+{
+  wait_pending(eid);
+  extent_protocol::attr a;
+  extent_protocol::status ret =
+    server(eid)->call(extent_protocol::write_range, eid, off, buf, true, a);
+  if (ret == extent_protocol::OK)
+    refresh(eid, a);
+  return ret;
+}
+
 extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
+  wait_pending(eid);
   int r;
   extent_protocol::status ret = 
-    cl->call(extent_protocol::remove, eid, true, r);
+    server(eid)->call(extent_protocol::remove, eid, true, r);
+  {
+    std::lock_guard<std::mutex> l(m);
+    changes++;
+    cache.erase(eid);
+    names.erase(eid);
+  }
 
   // std::cout << "remove ret: " << ret << std::endl;
 
   return ret;
 }
 
+// Run ops as one transaction in one RPC; created gets the inums the
+// creates made, in order. The caller holds the locks the ops need.
+// All of them must be on one shard: shard, or if that is -1, the shard
+// of the first inode an op names. Creates make their inodes there.
+extent_protocol::status
+extent_client::exec_tx(std::vector<extent_protocol::tx_op> ops,
+                       std::vector<extent_protocol::extentid_t> &created,
+                       int shard)
+{
+  for (size_t i = 0; shard < 0 && i < ops.size(); i++)
+    if (ops[i].kind != extent_protocol::TX_CREATE &&
+        !extent_protocol::is_new_inum(ops[i].eid))
+      shard = shard_of(ops[i].eid);
+  if (shard < 0)
+    shard = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i].kind != extent_protocol::TX_CREATE &&
+        !extent_protocol::is_new_inum(ops[i].eid))
+      wait_pending(ops[i].eid);
+  }
+
+  extent_protocol::tx_result res;
+  extent_protocol::status ret =
+    cls[shard]->call(extent_protocol::exec_tx, ops, true, res);
+  if (ret != extent_protocol::OK)
+    return ret;
+  created = res.created;
+
+  for (size_t i = 0; i < ops.size() && i < res.attrs.size(); i++) {
+    extent_protocol::tx_op &o = ops[i];
+    extent_protocol::extentid_t eid = o.eid;
+    if (extent_protocol::is_new_inum(eid))
+      eid = created[eid & ~extent_protocol::NEW_INUM];
+    if (o.kind == extent_protocol::TX_PUT) {
+      if (o.patch_at >= 0)
+        memcpy(&o.data[o.patch_at], &created[o.patch_new], sizeof(eid));
+      refresh(eid, res.attrs[i], &o.data);
+    } else if (o.kind == extent_protocol::TX_WRITE_RANGE) {
+      refresh(eid, res.attrs[i]);
+    } else if (o.kind == extent_protocol::TX_REMOVE) {
+      std::lock_guard<std::mutex> l(m);
+      changes++;
+      cache.erase(eid);
+      names.erase(eid);
+    } else if (o.kind == extent_protocol::TX_DIR_ADD ||
+               o.kind == extent_protocol::TX_DIR_REMOVE) {
+      // make the edit the server made to what we have of the directory
+      extent_protocol::extentid_t t = o.target;
+      if (extent_protocol::is_new_inum(t))
+        t = created[t & ~extent_protocol::NEW_INUM];
+      std::string d;
+      bool has_data = false;
+      {
+        std::lock_guard<std::mutex> l(m);
+        std::map<extent_protocol::extentid_t, cached>::iterator it =
+          cache.find(eid);
+        if (it != cache.end() && it->second.has_data) {
+          d = it->second.data;
+          has_data = true;
+        }
+        if (o.kind == extent_protocol::TX_DIR_ADD) {
+          if (names.count(eid))
+            names[eid][o.data] = t;
+          if (has_data)
+            d.append(extent_protocol::dir_entry(o.data, t));
+        } else {
+          if (names.count(eid))
+            names[eid].erase(o.data);
+          size_t pos = extent_protocol::dir_find(d, o.data);
+          if (has_data && pos != std::string::npos)
+            extent_protocol::dir_erase(d, pos);
+        }
+      }
+      refresh(eid, res.attrs[i], has_data ? &d : NULL);
+    }
+  }
+  return ret;
+}
+
 extent_protocol::status 
 extent_client::begin_tx()
 {
@@ -87,16 +426,19 @@ extent_client::begin_tx()
   return ret;
 }
 
+// Everything sent asynchronously is part of the transaction, so it
+// has to reach the server before the commit does.
 extent_protocol::status 
 extent_client::commit_tx()
 {
+  extent_protocol::status fret = flush();
   int r1,r2;
   extent_protocol::status ret = 
     cl->call(extent_protocol::commit_tx, r1, r2);
 
   // std::cout << "commit_tx ret: " << ret << std::endl;
 
-  return ret;
+  return fret != extent_protocol::OK ? fret : ret;
 }
 
 extent_protocol::status 
@@ -111,3 +453,234 @@ extent_client::checkpoint()
   return ret;
 } 
 
+extent_client::future
+extent_client::put_async(extent_protocol::extentid_t eid, std::string buf)
+{
+  return issue(extent_protocol::tx_op::put(eid, buf));
+}
+
+extent_client::future
+extent_client::write_range_async(extent_protocol::extentid_t eid,
+                                 unsigned long long off, std::string buf)
+{
+  return issue(extent_protocol::tx_op::write_range(eid, off, buf));
+}
+
+extent_client::future
+extent_client::remove_async(extent_protocol::extentid_t eid)
+{
+  return issue(extent_protocol::tx_op::remove(eid));
+}
+
+// Queue op behind the calls on its inode it must follow, and make the
+// cache show what it will do.
+extent_client::future
+extent_client::issue(const extent_protocol::tx_op &op)
+{
+  extent_protocol::extentid_t eid = op.eid;
+  bool whole = op.kind != extent_protocol::TX_WRITE_RANGE;
+  unsigned long long end = op.off + op.data.size();
+  std::shared_ptr<std::promise<extent_protocol::status> > p(
+    new std::promise<extent_protocol::status>);
+  future done = p->get_future().share();
+  std::vector<future> deps;
+  unsigned long long seq;
+  {
+    std::unique_lock<std::mutex> l(m);
+    while (pend[eid].ops.size() >= WINDOW)
+      pend_cv.wait(l);
+    pending &pd = pend[eid];
+    if (pd.err != extent_protocol::OK) {
+      // an earlier call failed: report it here rather than build on it
+      p->set_value(pd.err);
+      pd.err = extent_protocol::OK;
+      if (pd.ops.empty())
+        pend.erase(eid);
+      return done;
+    }
+    for (size_t i = 0; i < pd.ops.size(); i++) {
+      inflight &o = pd.ops[i];
+      if (whole || o.whole || (op.off < o.end && o.off < end))
+        deps.push_back(o.done);
+    }
+    seq = next_seq++;
+    changes++;
+    inflight f = { seq, whole, op.off, end, done };
+    pd.ops.push_back(f);
+
+    std::map<extent_protocol::extentid_t, cached>::iterator it =
+      cache.find(eid);
+    if (op.kind == extent_protocol::TX_REMOVE) {
+      if (it != cache.end())
+        cache.erase(it);
+      names.erase(eid);
+    } else if (it != cache.end()) {
+      extent_protocol::attr &a = it->second.a;
+      a.mtime = a.ctime = time(0);
+      if (op.kind == extent_protocol::TX_PUT) {
+        a.size = op.data.size();
+        if (it->second.has_data)
+          it->second.data = op.data;
+      } else {
+        if (end > a.size)
+          a.size = end;
+        it->second.has_data = false;
+      }
+    }
+
+    job j = { op, seq, deps, p };
+    jobs.push_back(j);
+  }
+  jobs_cv.notify_one();
+  return done;
+}
+
+static bool
+answered(const std::vector<std::shared_future<extent_protocol::status> > &fs)
+{
+  for (size_t i = 0; i < fs.size(); i++) {
+    if (fs[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+      return false;
+  }
+  return true;
+}
+
+// Take the oldest job that may go now. The oldest of all only waits on
+// jobs already taken, so some sender always gets on.
+void
+extent_client::sender_loop()
+{
+  std::unique_lock<std::mutex> l(m);
+  while (true) {
+    std::deque<job>::iterator it = jobs.begin();
+    while (it != jobs.end() && !answered(it->deps))
+      ++it;
+    if (it != jobs.end()) {
+      job j = *it;
+      jobs.erase(it);
+      l.unlock();
+      send(j);
+      l.lock();
+      continue;
+    }
+    if (stopping && jobs.empty())
+      return;
+    jobs_cv.wait(l);
+  }
+}
+
+// Send a job's op as a one-op transaction, so it is logged like any
+// other write, unless a lapsed lease dropped it.
+void
+extent_client::send(const job &j)
+{
+  const extent_protocol::tx_op &op = j.op;
+  extent_protocol::extentid_t eid = op.eid;
+  bool dropped;
+  {
+    std::lock_guard<std::mutex> l(m);
+    dropped = j.seq < pend[eid].drop_below;
+  }
+  std::vector<extent_protocol::tx_op> ops(1, op);
+  extent_protocol::tx_result res;
+  extent_protocol::status ret = extent_protocol::IOERR;
+  if (!dropped)
+    ret = server(eid)->call(extent_protocol::exec_tx, ops, true, res);
+
+  {
+    std::lock_guard<std::mutex> l(m);
+    pending &pd = pend[eid];
+    for (size_t i = 0; i < pd.ops.size(); i++) {
+      if (pd.ops[i].seq == j.seq) {
+        pd.ops.erase(pd.ops.begin() + i);
+        break;
+      }
+    }
+    if (ret != extent_protocol::OK) {
+      if (pd.err == extent_protocol::OK)
+        pd.err = ret;
+    } else if (op.kind != extent_protocol::TX_REMOVE && !res.attrs.empty()) {
+      // Writes answered together may come back in any order, but they
+      // only grow the file; a put has nothing else outstanding.
+      const extent_protocol::attr &a = res.attrs[0];
+      if (op.kind == extent_protocol::TX_PUT || !pd.has_a) {
+        pd.a = a;
+      } else {
+        pd.a.size = std::max(pd.a.size, a.size);
+        pd.a.mtime = std::max(pd.a.mtime, a.mtime);
+        pd.a.ctime = std::max(pd.a.ctime, a.ctime);
+      }
+      pd.has_a = true;
+    }
+    changes++;
+    if (pd.ops.empty()) {
+      // what the server says replaces what issue guessed
+      std::map<extent_protocol::extentid_t, cached>::iterator it =
+        cache.find(eid);
+      if (pd.has_a && it != cache.end())
+        it->second.a = pd.a;
+      pd.has_a = false;
+      if (pd.err == extent_protocol::OK)
+        pend.erase(eid);
+    }
+    // under m, so a sender that found this job's followers not ready
+    // is already waiting for the notify
+    j.p->set_value(ret);
+  }
+  pend_cv.notify_all();
+  jobs_cv.notify_all();
+}
+
+// Wait for the async calls made so far on eid, keeping any failure for
+// flush.
+void
+extent_client::wait_pending(extent_protocol::extentid_t eid)
+{
+  std::vector<future> fs;
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<extent_protocol::extentid_t, pending>::iterator it =
+      pend.find(eid);
+    if (it == pend.end())
+      return;
+    for (size_t i = 0; i < it->second.ops.size(); i++)
+      fs.push_back(it->second.ops[i].done);
+  }
+  for (size_t i = 0; i < fs.size(); i++)
+    fs[i].wait();
+}
+
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid)
+{
+  wait_pending(eid);
+  std::lock_guard<std::mutex> l(m);
+  std::map<extent_protocol::extentid_t, pending>::iterator it =
+    pend.find(eid);
+  if (it == pend.end())
+    return extent_protocol::OK;
+  extent_protocol::status ret = it->second.err;
+  it->second.err = extent_protocol::OK;
+  if (it->second.ops.empty())
+    pend.erase(it);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::flush()
+{
+  std::vector<extent_protocol::extentid_t> eids;
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<extent_protocol::extentid_t, pending>::iterator it;
+    for (it = pend.begin(); it != pend.end(); ++it)
+      eids.push_back(it->first);
+  }
+  extent_protocol::status ret = extent_protocol::OK;
+  for (size_t i = 0; i < eids.size(); i++) {
+    extent_protocol::status r = flush(eids[i]);
+    if (ret == extent_protocol::OK)
+      ret = r;
+  }
+  return ret;
+}
@@ -4,15 +4,120 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <future>
+#include <memory>
+#include <condition_variable>
 #include "extent_protocol.h"
 #include "extent_server.h"
+#include "lock_client_cache.h"
+
+// extent_client keeps the attributes of inodes whose lock this client
+// holds, and the contents of such directories, so repeated getattrs and
+// lookups cost a single RPC. Passed to lock_client_cache as its
+// lock_release_user, it drops what it has on an inode when the inode
+// lock goes back to the server, so callers must hold the inode lock (in
+// either mode) around get and getattr. put and write_range refresh what
+// is cached from their replies.
+//
+// Every write, like anything else that changes an inode, takes its
+// lock EXCLUSIVE, so what is cached stays what the server has.
+//
+// Names found by dir_lookup are kept under the same rule as the
+// attributes of the directory they were found in.
+//
+// put_async, write_range_async and remove_async send a mutation and
+// return at once; the cached attributes are changed to what it will
+// make them, so a writer streaming into a file does not wait a round
+// trip per call. Up to WINDOW of them per inode are outstanding at a
+// time. Each one is sent only after those before it on the same inode
+// that it could conflict with have been answered: a put or remove
+// after everything, a write after earlier writes to overlapping bytes.
+// Every other call on the inode, and dorelease, waits for them first,
+// so the server has them before the inode lock leaves this client. A
+// failure is kept, even after the lock has gone, and returned by the
+// next flush of the inode, or by the next async call on it, which is
+// then not sent. If a lapsed lease
+// takes the lock instead (dolapse), those not yet sent are dropped:
+// they fail with IOERR rather than reach a server that may have handed
+// the inode to someone else. NSENDER threads do the sending; each takes
+// the oldest queued call whose predecessors are answered.
+class extent_client : public lock_release_user {
+ public:
+  typedef std::shared_future<extent_protocol::status> future;
 
-class extent_client {
  private:
-  rpcc *cl;
+  enum { WINDOW = 8, NSENDER = 8 };
+
+  struct cached {
+    extent_protocol::attr a;
+    bool has_data;       // directories only
+    std::string data;
+  };
+  struct inflight {
+    unsigned long long seq;
+    bool whole;                    // a put or remove
+    unsigned long long off, end;   // the bytes a write changes
+    future done;
+  };
+  struct pending {
+    std::vector<inflight> ops;
+    bool has_a;
+    extent_protocol::attr a;       // from the replies so far
+    extent_protocol::status err;   // the first failure, until flushed
+    unsigned long long drop_below; // ops before this seq are not sent
+    pending() : has_a(false), err(extent_protocol::OK), drop_below(0) {}
+  };
+
+  std::vector<rpcc *> cls;   // one per shard, in shard order
+  rpcc *cl;                  // cls[0]
+  rpcc *server(extent_protocol::extentid_t eid) const {
+    return cls[shard_of(eid)];
+  }
+  std::mutex m;
+  std::map<extent_protocol::extentid_t, cached> cache;
+  std::map<extent_protocol::extentid_t,
+           std::map<std::string, extent_protocol::extentid_t> > names;
+  std::map<extent_protocol::extentid_t, pending> pend;
+  std::condition_variable pend_cv;
+  unsigned long long next_seq;
+  // moves on whenever what is cached changes other than by a fetch
+  unsigned long long changes;
+
+  struct job {
+    extent_protocol::tx_op op;
+    unsigned long long seq;
+    std::vector<future> deps;      // answered before op may go
+    std::shared_ptr<std::promise<extent_protocol::status> > p;
+  };
+  std::deque<job> jobs;            // issued, not yet taken by a sender
+  std::condition_variable jobs_cv;
+  std::vector<std::thread> senders;
+  bool stopping;
+
+  void refresh(extent_protocol::extentid_t, const extent_protocol::attr &,
+               const std::string *data = NULL);
+  future issue(const extent_protocol::tx_op &);
+  void sender_loop();
+  void send(const job &);
+  void wait_pending(extent_protocol::extentid_t);
 
  public:
+  // dst names one extent server or a file listing the shards' servers
+  // in shard order (see server_list.h and extent_server.h)
   extent_client(std::string dst);
+  // sends whatever is still queued before it goes
+  ~extent_client();
+  int nshards() const { return cls.size(); }
+  int shard_of(extent_protocol::extentid_t) const;
+  int place(extent_protocol::extentid_t parent, const std::string &name,
+            uint32_t type) const;
+  void dorelease(lock_protocol::lockid_t);
+  void dolapse(lock_protocol::lockid_t);
 
   extent_protocol::status checkpoint();
   extent_protocol::status begin_tx();
@@ -20,10 +125,43 @@ class extent_client {
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
+  extent_protocol::status get(extent_protocol::extentid_t eid,
+                              std::string &buf, extent_protocol::attr &a);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
+  extent_protocol::status readdirplus(extent_protocol::extentid_t eid,
+                                      std::vector<extent_protocol::dirent> &);
+  // Keep a, fetched after generation() returned gen, as eid's
+  // attributes, unless eid has some cached already or async calls out,
+  // or anything cached has changed since gen. The caller must have
+  // held eid's lock since before it called generation().
+  unsigned long long generation();
+  void seed(extent_protocol::extentid_t eid, const extent_protocol::attr &a,
+            unsigned long long gen);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf, bool iflog = true);
+  extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                     unsigned long long off,
+                                     unsigned long long len, std::string &buf);
+  extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                      unsigned long long off, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status dir_lookup(extent_protocol::extentid_t dir,
+                                     const std::string &name,
+                                     extent_protocol::extentid_t &ino);
+  extent_protocol::status dir_list(extent_protocol::extentid_t dir,
+                                   std::vector<extent_protocol::dentry> &);
+  extent_protocol::status exec_tx(std::vector<extent_protocol::tx_op> ops,
+                                  std::vector<extent_protocol::extentid_t> &created,
+                                  int shard = -1);
+
+  future put_async(extent_protocol::extentid_t eid, std::string buf);
+  future write_range_async(extent_protocol::extentid_t eid,
+                           unsigned long long off, std::string buf);
+  future remove_async(extent_protocol::extentid_t eid);
+  // wait for the async calls made so far on eid, or on every inode,
+  // and return the first of them that failed
+  extent_protocol::status flush(extent_protocol::extentid_t eid);
+  extent_protocol::status flush();
 };
 
 #endif 
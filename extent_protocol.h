@@ -3,13 +3,19 @@
 #ifndef extent_protocol_h
 #define extent_protocol_h
 
+#include <vector>
+#include <string.h>
 #include "rpc.h"
 
+// Directory contents are ENTRY_SIZE-byte records: the entry's name,
+// NUL-padded, with its inum in the last 8 bytes.
+#define ENTRY_SIZE 68
+
 class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
   enum rpc_numbers {
     put = 0x6001,
     get,
@@ -19,6 +25,15 @@ class extent_protocol {
     begin_tx,
     commit_tx,
     checkpoint,
+    read_range,
+    write_range,
+    get_with_attr,
+    readdirplus,
+    exec_tx,
+    dir_lookup,
+    dir_add,
+    dir_remove,
+    dir_list,
   };
 
   enum types {
@@ -34,6 +49,128 @@ class extent_protocol {
     unsigned int ctime;
     unsigned int size;
   };
+
+  // get_with_attr's reply
+  struct attr_data {
+    attr a;
+    std::string data;
+  };
+
+  // a readdirplus entry: a directory entry and its inode's attributes
+  struct dirent {
+    std::string name;
+    extentid_t inum;
+    attr a;
+  };
+
+  // a dir_list entry
+  struct dentry {
+    std::string name;
+    extentid_t inum;
+  };
+
+  // The directory entry format, shared by the server, which edits
+  // directories in place, and extent_client, which mirrors those edits
+  // on what it caches. Names longer than MAXNAME do not fit.
+  enum { MAXNAME = ENTRY_SIZE - 9 };
+  static std::string dir_entry(const std::string &name, extentid_t inum) {
+    char e[ENTRY_SIZE] = {0};
+    strncpy(e, name.c_str(), MAXNAME);
+    memcpy(e + ENTRY_SIZE - 8, &inum, sizeof(inum));
+    return std::string(e, ENTRY_SIZE);
+  }
+  // offset of name's entry in dir, or std::string::npos
+  static size_t dir_find(const std::string &dir, const std::string &name) {
+    if (name.size() > MAXNAME)
+      return std::string::npos;
+    for (size_t i = 0; i + ENTRY_SIZE <= dir.size(); i += ENTRY_SIZE)
+      if (dir.compare(i, name.size(), name) == 0 && dir[i + name.size()] == '\0')
+        return i;
+    return std::string::npos;
+  }
+  static extentid_t dir_inum(const std::string &dir, size_t pos) {
+    extentid_t inum;
+    memcpy(&inum, dir.data() + pos + ENTRY_SIZE - 8, sizeof(inum));
+    return inum;
+  }
+  // entries are unordered: the last one moves into the hole
+  static void dir_erase(std::string &dir, size_t pos) {
+    size_t last = dir.size() - ENTRY_SIZE;
+    if (pos != last)
+      dir.replace(pos, ENTRY_SIZE, dir, last, ENTRY_SIZE);
+    dir.resize(last);
+  }
+
+  // One step of an exec_tx transaction. Where an op names an inode, it
+  // may instead name new_inum(k), the inode made by the transaction's
+  // k-th create; a put may likewise store that inum at patch_at in its
+  // data. TX_DIR_ADD and TX_DIR_REMOVE edit directory eid in place,
+  // moving one entry rather than the whole directory.
+  enum tx_kind { TX_CREATE = 1, TX_PUT, TX_WRITE_RANGE, TX_REMOVE,
+                 TX_DIR_ADD, TX_DIR_REMOVE };
+  struct tx_op {
+    int kind;
+    extentid_t eid;
+    uint32_t type;             // TX_CREATE
+    unsigned long long off;    // TX_WRITE_RANGE
+    std::string data;          // TX_PUT, TX_WRITE_RANGE; the name for TX_DIR_*
+    int patch_at;              // TX_PUT: -1, or where new_inum(patch_new) goes
+    int patch_new;
+    extentid_t target;         // TX_DIR_ADD: the entry's inode
+
+    static tx_op create(uint32_t type) {
+      tx_op o = blank(TX_CREATE, 0);
+      o.type = type;
+      return o;
+    }
+    static tx_op put(extentid_t eid, const std::string &data) {
+      tx_op o = blank(TX_PUT, eid);
+      o.data = data;
+      return o;
+    }
+    static tx_op write_range(extentid_t eid, unsigned long long off,
+                             const std::string &data) {
+      tx_op o = blank(TX_WRITE_RANGE, eid);
+      o.off = off;
+      o.data = data;
+      return o;
+    }
+    static tx_op remove(extentid_t eid) { return blank(TX_REMOVE, eid); }
+    static tx_op dir_add(extentid_t dir, const std::string &name,
+                         extentid_t target) {
+      tx_op o = blank(TX_DIR_ADD, dir);
+      o.data = name;
+      o.target = target;
+      return o;
+    }
+    static tx_op dir_remove(extentid_t dir, const std::string &name) {
+      tx_op o = blank(TX_DIR_REMOVE, dir);
+      o.data = name;
+      return o;
+    }
+   private:
+    static tx_op blank(int kind, extentid_t eid) {
+      tx_op o;
+      o.kind = kind;
+      o.eid = eid;
+      o.type = 0;
+      o.off = 0;
+      o.patch_at = -1;
+      o.patch_new = 0;
+      o.target = 0;
+      return o;
+    }
+  };
+  static extentid_t new_inum(int k) { return NEW_INUM | (extentid_t) k; }
+  static bool is_new_inum(extentid_t eid) { return (eid & NEW_INUM) != 0; }
+  static const extentid_t NEW_INUM = 1ULL << 63;
+
+  // exec_tx's reply: the inums made by its creates, in order, and each
+  // op's inode's attributes once the op is done
+  struct tx_result {
+    std::vector<extentid_t> created;
+    std::vector<attr> attrs;
+  };
 };
 
 inline unmarshall &
@@ -58,4 +195,98 @@ operator<<(marshall &m, extent_protocol::attr a)
   return m;
 }
 
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::attr_data &r)
+{
+  u >> r.a;
+  u >> r.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::attr_data r)
+{
+  m << r.a;
+  m << r.data;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirent &e)
+{
+  u >> e.name;
+  u >> e.inum;
+  u >> e.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::dirent e)
+{
+  m << e.name;
+  m << e.inum;
+  m << e.a;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dentry &e)
+{
+  u >> e.name;
+  u >> e.inum;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::dentry e)
+{
+  m << e.name;
+  m << e.inum;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::tx_op &o)
+{
+  u >> o.kind;
+  u >> o.eid;
+  u >> o.type;
+  u >> o.off;
+  u >> o.data;
+  u >> o.patch_at;
+  u >> o.patch_new;
+  u >> o.target;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::tx_op o)
+{
+  m << o.kind;
+  m << o.eid;
+  m << o.type;
+  m << o.off;
+  m << o.data;
+  m << o.patch_at;
+  m << o.patch_new;
+  m << o.target;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::tx_result &r)
+{
+  u >> r.created;
+  u >> r.attrs;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, extent_protocol::tx_result r)
+{
+  m << r.created;
+  m << r.attrs;
+  return m;
+}
+
 #endif 
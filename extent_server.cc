@@ -8,101 +8,146 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <algorithm>
 
 #include "extent_server.h"
 #include "persister.h"
+#include "tlog.h"
 
-extent_server::extent_server() 
+extent_server::extent_server(int shard0, int nshards0)
+  : shard(shard0), nshards(nshards0)
 {
   im = new inode_manager();
-  _persister = new chfs_persister("log"); // DO NOT change the dir name here
+  // shard 0 keeps the log where a lone server always has
+  std::string dir = "log"; // DO NOT change the dir name here
+  if (shard > 0) {
+    dir += "/shard" + std::to_string(shard);
+    mkdir(dir.c_str(), 0777);
+  }
+  _persister = new chfs_persister(dir);
   
   // Your code here for Lab2A: recover data on startup
   _persister->restore_checkpoint(im);
-  _persister->restore_logdata(this, txid);
+  txid_t t = 0;
+  _persister->restore_logdata(this, t);
+  txid = t;
 }
 
+// The mutations below are one-op transactions when called on their own,
+// like dir_add and dir_remove, so each is logged as a record that
+// replays without a BEGIN or COMMIT around it.
 int extent_server::create(uint32_t type, bool iflog, extent_protocol::extentid_t &id)
 {
-  // prepare log entry
-  if (iflog) {
-    // printf("log extent_server: create inode\n");
-    chfs_command cmd(chfs_command::CMD_CREATE, txid);
-    cmd.redo_act = new act::create_action(type);
-    // cmd.undo_act = new act::remove_action(id);
-    // std::cout << cmd.type << ' ' << cmd.id << ' ' << cmd.size() << std::endl;
-    // std::cout << id << std::endl;
-    _persister->append_log(cmd);
-
-    if (cmd.redo_act) delete cmd.redo_act; 
-    // delete cmd.undo_act;
-  }
+  extent_protocol::tx_result res;
+  int r = exec_tx({extent_protocol::tx_op::create(type)}, iflog, res);
+  if (r == extent_protocol::OK)
+    id = res.created[0];
+  return r;
+}
 
+void extent_server::do_create(uint32_t type, extent_protocol::extentid_t &id)
+{
   // alloc a new inode and return inum
-  printf("extent_server: create inode\n");
-  id = im->alloc_inode(type);
-
-  return extent_protocol::OK;
+  tlog_debug("extent_server: create inode\n");
+  uint32_t l = im->alloc_inode(type);
+  id = l ? global(l) : 0;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, bool iflog, int &)
+// Replies with the new attributes, so the client need not ask.
+int extent_server::put(extent_protocol::extentid_t id, std::string buf, bool iflog,
+                       extent_protocol::attr &a)
 {
-  // prepare log entry
-  if (iflog) {
-    // printf("log extent_server: put %lld\n", id);
-    std::string old_content;
-    // get(id, old_content);
-    chfs_command cmd(chfs_command::CMD_PUT, txid);
-    cmd.redo_act = new act::put_action(id, buf);
-    // cmd.undo_act = new act::put_action(id, old_content);
-    // std::cout << cmd.type << ' ' << cmd.id << ' ' << cmd.size() << std::endl;
-    // std::cout << buf.size() << ' ' << buf << std::endl;
-    _persister->append_log(cmd);
-
-    if (cmd.redo_act) delete cmd.redo_act; 
-    // delete cmd.undo_act;
-    // std::cout << "after log\n";
-  }
-  
+  extent_protocol::tx_result res;
+  int r = exec_tx({extent_protocol::tx_op::put(id, buf)}, iflog, res);
+  if (r == extent_protocol::OK)
+    a = res.attrs[0];
+  return r;
+}
 
-  printf("extent_server: put %lld\n", id);
+int extent_server::do_put(extent_protocol::extentid_t id, const std::string &buf,
+                          extent_protocol::attr &a, uint32_t *reservation)
+{
+  tlog_debug("extent_server: put %lld\n", id);
   // std::cout << buf << std::endl;
-  id &= 0x7fffffff;
+  id = local(id);
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
-  im->write_file(id, cbuf, size);
-  
-  return extent_protocol::OK;
+  bool ok = im->write_file(id, cbuf, size, reservation);
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  return ok ? extent_protocol::OK : extent_protocol::IOERR;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
-  printf("extent_server: get %lld\n", id);
+  tlog_debug("extent_server: get %lld\n", id);
 
-  id &= 0x7fffffff;
+  // a read writes back atime, which a checkpoint must not catch halfway
+  std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+  std::shared_lock<std::shared_mutex> l(ilock(id));
+  do_get(id, buf);
 
-  int size = 0;
-  char *cbuf = NULL;
+  return extent_protocol::OK;
+}
 
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    buf = "";
-  else {
-    buf.assign(cbuf, size);
-    free(cbuf);
-  }
+void extent_server::do_get(extent_protocol::extentid_t id, std::string &buf)
+{
+  id = local(id);
+  im->read_file(id, buf);
+}
 
-  // std::cout << buf << std::endl;
+int extent_server::read_range(extent_protocol::extentid_t id,
+                              unsigned long long off, unsigned long long len,
+                              std::string &buf)
+{
+  tlog_debug("extent_server: read_range %lld %llu+%llu\n", id, off, len);
+
+  std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+  std::shared_lock<std::shared_mutex> l(ilock(id));
+  id = local(id);
+
+  buf = "";
+  if (off >= MAXFILE * BLOCK_SIZE)
+    return extent_protocol::OK;
+  if (len > MAXFILE * BLOCK_SIZE)
+    len = MAXFILE * BLOCK_SIZE;
+  im->read_range(id, off, len, buf);
 
   return extent_protocol::OK;
 }
 
+// Only the written bytes go to the log, not the whole file.
+int extent_server::write_range(extent_protocol::extentid_t id,
+                               unsigned long long off, std::string buf,
+                               bool iflog, extent_protocol::attr &a)
+{
+  extent_protocol::tx_result res;
+  int r = exec_tx({extent_protocol::tx_op::write_range(id, off, buf)}, iflog, res);
+  if (r == extent_protocol::OK)
+    a = res.attrs[0];
+  return r;
+}
+
+int extent_server::do_write_range(extent_protocol::extentid_t id,
+                                  unsigned long long off, const std::string &buf,
+                                  extent_protocol::attr &a, uint32_t *reservation)
+{
+  tlog_debug("extent_server: write_range %lld %llu+%zu\n", id, off, buf.size());
+
+  id = local(id);
+  bool ok = im->write_range(id, off, buf.data(), buf.size(), reservation);
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  return ok ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-  printf("extent_server: getattr %lld\n", id);
+  tlog_debug("extent_server: getattr %lld\n", id);
 
-  id &= 0x7fffffff;
+  std::shared_lock<std::shared_mutex> l(ilock(id));
+  id = local(id);
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
@@ -112,32 +157,379 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, bool iflog, int &)
+// Both under one hold of the inode lock, so they agree.
+int extent_server::get_with_attr(extent_protocol::extentid_t id,
+                                 extent_protocol::attr_data &r)
 {
-  // prepare log entry
-  if (iflog) {
-    // printf("log extent_server: remove %lld\n", id);
-    extent_protocol::attr attr;
-    getattr(id, attr);
-    chfs_command cmd(chfs_command::CMD_REMOVE, txid);
-    cmd.redo_act = new act::remove_action(id);
-    // cmd.undo_act = new act::create_action(attr.type);
-    // std::cout << cmd.type << ' ' << cmd.id << ' ' << cmd.size() << std::endl;
-    _persister->append_log(cmd);
-
-    if (cmd.redo_act) delete cmd.redo_act; 
-    // delete cmd.undo_act;
+  tlog_debug("extent_server: get_with_attr %lld\n", id);
+
+  std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+  std::shared_lock<std::shared_mutex> l(ilock(id));
+  do_get(id, r.data);
+  memset(&r.a, 0, sizeof(r.a));
+  im->get_attr(local(id), r.a);
+
+  return extent_protocol::OK;
+}
+
+// The entries of directory id, each with its inode's attributes, so a
+// listing needs no getattr per entry.
+int extent_server::readdirplus(extent_protocol::extentid_t id,
+                               std::vector<extent_protocol::dirent> &ents)
+{
+  std::vector<extent_protocol::dentry> names;
+  dir_list(id, names);
+
+  ents.clear();
+  for (size_t i = 0; i < names.size(); i++) {
+    extent_protocol::dirent e;
+    e.name = names[i].name;
+    e.inum = names[i].inum;
+    // an entry on another shard is left for the client to ask about
+    memset(&e.a, 0, sizeof(e.a));
+    if (owns(e.inum))
+      getattr(e.inum, e.a);
+    ents.push_back(e);
   }
-  
 
-  printf("extent_server: remove %lld\n", id);
+  return extent_protocol::OK;
+}
+
+// Directory operations run here against the directory inode, so only
+// the name and inum cross the wire, and an add or remove rewrites one
+// entry's worth of blocks rather than the whole directory.
+//
+// Finding a name still reads the whole directory out of inode_manager
+// and scans it: dir_lookup, do_dir_remove and tx_check's dir checks
+// all cost O(entries) here, as they did in the client before. What
+// went away is the copy over RPC and into the log, not the scan.
+
+int extent_server::dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                              extent_protocol::extentid_t &ino)
+{
+  tlog_debug("extent_server: dir_lookup %lld %s\n", dir, name.c_str());
+
+  std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+  std::shared_lock<std::shared_mutex> l(ilock(dir));
+  std::string d;
+  do_get(dir, d);
+  size_t pos = extent_protocol::dir_find(d, name);
+  if (pos == std::string::npos)
+    return extent_protocol::NOENT;
+  ino = extent_protocol::dir_inum(d, pos);
+  return extent_protocol::OK;
+}
+
+int extent_server::dir_list(extent_protocol::extentid_t dir,
+                            std::vector<extent_protocol::dentry> &ents)
+{
+  tlog_debug("extent_server: dir_list %lld\n", dir);
+
+  std::string d;
+  {
+    std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+    std::shared_lock<std::shared_mutex> l(ilock(dir));
+    do_get(dir, d);
+  }
+
+  ents.clear();
+  for (size_t i = 0; i + ENTRY_SIZE <= d.size(); i += ENTRY_SIZE) {
+    extent_protocol::dentry e;
+    e.name = std::string(d.c_str() + i);
+    e.inum = extent_protocol::dir_inum(d, i);
+    ents.push_back(e);
+  }
+  return extent_protocol::OK;
+}
+
+// dir_add and dir_remove on their own are one-op transactions.
+int extent_server::dir_add(extent_protocol::extentid_t dir, std::string name,
+                           extent_protocol::extentid_t ino, int &)
+{
+  extent_protocol::tx_result res;
+  return exec_tx({extent_protocol::tx_op::dir_add(dir, name, ino)}, true, res);
+}
+
+int extent_server::dir_remove(extent_protocol::extentid_t dir, std::string name,
+                              int &)
+{
+  extent_protocol::tx_result res;
+  return exec_tx({extent_protocol::tx_op::dir_remove(dir, name)}, true, res);
+}
+
+int extent_server::do_dir_add(extent_protocol::extentid_t dir,
+                              const std::string &name,
+                              extent_protocol::extentid_t ino,
+                              extent_protocol::attr &a, uint32_t *reservation)
+{
+  tlog_debug("extent_server: dir_add %lld %s -> %lld\n", dir, name.c_str(), ino);
+
+  dir = local(dir);
+  std::string e = extent_protocol::dir_entry(name, ino);
+  memset(&a, 0, sizeof(a));
+  im->get_attr(dir, a);
+  bool ok = im->write_range(dir, a.size, e.data(), e.size(), reservation);
+  im->get_attr(dir, a);
+  return ok ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+void extent_server::do_dir_remove(extent_protocol::extentid_t dir,
+                                  const std::string &name,
+                                  extent_protocol::attr &a)
+{
+  tlog_debug("extent_server: dir_remove %lld %s\n", dir, name.c_str());
+
+  std::string d;
+  do_get(dir, d);
+  dir = local(dir);
+  memset(&a, 0, sizeof(a));
+  size_t pos = extent_protocol::dir_find(d, name);
+  if (pos != std::string::npos) {
+    // the same move dir_erase makes, done on the blocks
+    size_t last = d.size() - ENTRY_SIZE;
+    if (pos != last)
+      im->write_range(dir, pos, d.data() + last, ENTRY_SIZE);
+    im->truncate(dir, last);
+  }
+  im->get_attr(dir, a);
+}
 
-  id &= 0x7fffffff;
+int extent_server::remove(extent_protocol::extentid_t id, bool iflog, int &)
+{
+  extent_protocol::tx_result res;
+  return exec_tx({extent_protocol::tx_op::remove(id)}, iflog, res);
+}
+
+void extent_server::do_remove(extent_protocol::extentid_t id)
+{
+  tlog_debug("extent_server: remove %lld\n", id);
+
+  id = local(id);
   im->remove_file(id);
- 
+}
+
+// Do placeholders only name earlier creates, and patches fit the data?
+bool extent_server::tx_valid(const std::vector<extent_protocol::tx_op> &ops)
+{
+  int ncreate = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    const extent_protocol::tx_op &o = ops[i];
+    if (o.kind < extent_protocol::TX_CREATE || o.kind > extent_protocol::TX_DIR_REMOVE)
+      return false;
+    if (o.kind != extent_protocol::TX_CREATE &&
+        extent_protocol::is_new_inum(o.eid) &&
+        (o.eid & ~extent_protocol::NEW_INUM) >= (extent_protocol::extentid_t) ncreate)
+      return false;
+    if (o.kind == extent_protocol::TX_PUT && o.patch_at >= 0 &&
+        (o.patch_new < 0 || o.patch_new >= ncreate ||
+         (size_t) o.patch_at + sizeof(extent_protocol::extentid_t) > o.data.size()))
+      return false;
+    if ((o.kind == extent_protocol::TX_DIR_ADD ||
+         o.kind == extent_protocol::TX_DIR_REMOVE) &&
+        (o.data.empty() || o.data.size() > extent_protocol::MAXNAME ||
+         o.data.find('\0') != std::string::npos))
+      return false;
+    if (o.kind == extent_protocol::TX_DIR_ADD &&
+        extent_protocol::is_new_inum(o.target) &&
+        (o.target & ~extent_protocol::NEW_INUM) >= (extent_protocol::extentid_t) ncreate)
+      return false;
+    if (o.kind == extent_protocol::TX_CREATE)
+      ncreate++;
+  }
+  return true;
+}
+
+// Blocks a file of size bytes takes.
+static unsigned long long
+nblocks(unsigned long long size)
+{
+  return (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Will each directory op find its name absent or present as it needs,
+// each write land inside the largest file, and each create get an
+// inode? Run under the tx's locks but before it is logged, so a tx that
+// fails here leaves no trace. Directories the tx itself makes start
+// empty. A tx that creates holds alloc_mtx, so the inodes counted free
+// here are still free when it applies.
+//
+// It also sets aside, in reservation, the most blocks the tx could
+// take: each write grows its file from the size the ops before it
+// leave, with an overflow block per EPB blocks added and one more.
+// Writes to other inodes cannot take those blocks, so applying the tx
+// never runs out of room; exec_tx hands back what it did not use.
+int extent_server::tx_check(const std::vector<extent_protocol::tx_op> &ops,
+                            uint32_t &reservation)
+{
+  uint32_t ncreate = 0;
+  unsigned long long nblock = 0;
+  std::map<extent_protocol::extentid_t, unsigned long long> size;
+  for (size_t i = 0; i < ops.size(); i++) {
+    const extent_protocol::tx_op &o = ops[i];
+    if (o.kind == extent_protocol::TX_CREATE) {
+      ncreate++;
+      continue;
+    }
+    if (o.kind == extent_protocol::TX_WRITE_RANGE &&
+        (o.off >= MAXFILE * BLOCK_SIZE ||
+         o.data.size() > MAXFILE * BLOCK_SIZE - o.off))
+      return extent_protocol::IOERR;
+
+    if (!size.count(o.eid)) {
+      extent_protocol::attr a;
+      memset(&a, 0, sizeof(a));
+      if (!extent_protocol::is_new_inum(o.eid))
+        im->get_attr(local(o.eid), a);
+      size[o.eid] = a.size;
+    }
+    unsigned long long cur = size[o.eid], end = cur;
+    if (o.kind == extent_protocol::TX_PUT)
+      end = o.data.size();
+    else if (o.kind == extent_protocol::TX_WRITE_RANGE)
+      end = std::max(cur, o.off + o.data.size());
+    else if (o.kind == extent_protocol::TX_DIR_ADD)
+      end = cur + ENTRY_SIZE;
+    else if (o.kind == extent_protocol::TX_DIR_REMOVE)
+      end = cur >= ENTRY_SIZE ? cur - ENTRY_SIZE : 0;
+    else if (o.kind == extent_protocol::TX_REMOVE)
+      end = 0;
+    if (nblocks(end) > nblocks(cur)) {
+      unsigned long long grow = nblocks(end) - nblocks(cur);
+      nblock += grow + grow / EPB + 1;
+    }
+    size[o.eid] = end;
+    if ((o.kind != extent_protocol::TX_DIR_ADD &&
+         o.kind != extent_protocol::TX_DIR_REMOVE) ||
+        extent_protocol::is_new_inum(o.eid))
+      continue;
+    extent_protocol::attr a;
+    memset(&a, 0, sizeof(a));
+    im->get_attr(local(o.eid), a);
+    if (a.type != extent_protocol::T_DIR)
+      return extent_protocol::IOERR;
+    // a scan of the whole directory; see dir_lookup
+    std::string d;
+    do_get(o.eid, d);
+    bool found = extent_protocol::dir_find(d, o.data) != std::string::npos;
+    if (o.kind == extent_protocol::TX_DIR_ADD && found)
+      return extent_protocol::EXIST;
+    if (o.kind == extent_protocol::TX_DIR_ADD &&
+        d.size() + ENTRY_SIZE > MAXFILE * BLOCK_SIZE)
+      return extent_protocol::IOERR;
+    if (o.kind == extent_protocol::TX_DIR_REMOVE && !found)
+      return extent_protocol::NOENT;
+  }
+  if (ncreate > 0 && im->free_inodes() < ncreate)
+    return extent_protocol::IOERR;
+  if (nblock > BLOCK_NUM || !im->reserve_blocks(nblock))
+    return extent_protocol::IOERR;
+  reservation = nblock;
   return extent_protocol::OK;
 }
 
+// A whole transaction in one RPC: the ops go to the log as one record,
+// which needs no begin or commit around it, and are then applied in
+// order. A tx is all or nothing: anything that could make an op fail,
+// a full disk included, fails tx_check before the record is logged, so
+// a tx that returns an error has changed nothing. Replaying the record
+// makes the same inodes, so placeholders resolve the same way again.
+int extent_server::exec_tx(std::vector<extent_protocol::tx_op> ops, bool iflog,
+                           extent_protocol::tx_result &res)
+{
+  if (!tx_valid(ops))
+    return extent_protocol::IOERR;
+
+  // every existing inode the tx touches is locked up front; inodes it
+  // creates are unknown to anyone else until it returns
+  bool allocates = false;
+  std::vector<std::shared_mutex *> ids;
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i].kind == extent_protocol::TX_CREATE ||
+        ops[i].kind == extent_protocol::TX_REMOVE)
+      allocates = true;
+    if (ops[i].kind != extent_protocol::TX_CREATE &&
+        !extent_protocol::is_new_inum(ops[i].eid))
+      ids.push_back(&ilock(ops[i].eid));
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  int r;
+  {
+    std::shared_lock<std::shared_mutex> ck(ckpt_mtx);
+    std::unique_lock<std::mutex> al(alloc_mtx, std::defer_lock);
+    if (allocates)
+      al.lock();
+    std::vector<std::unique_lock<std::shared_mutex> > ls;
+    for (size_t i = 0; i < ids.size(); i++)
+      ls.emplace_back(*ids[i]);
+
+    uint32_t reservation = 0;
+    r = tx_check(ops, reservation);
+    if (r != extent_protocol::OK)
+      return r;
+
+    if (iflog) {
+      chfs_command cmd(chfs_command::CMD_TX, txid);
+      cmd.redo_act = new act::tx_action(ops);
+      _persister->append_log(cmd);
+
+      if (cmd.redo_act) delete cmd.redo_act;
+    }
+
+    res.created.clear();
+    res.attrs.clear();
+    for (size_t i = 0; i < ops.size() && r == extent_protocol::OK; i++) {
+      extent_protocol::tx_op &o = ops[i];
+      extent_protocol::extentid_t eid = o.eid;
+      if (o.kind != extent_protocol::TX_CREATE && extent_protocol::is_new_inum(eid))
+        eid = res.created[eid & ~extent_protocol::NEW_INUM];
+
+      extent_protocol::attr a;
+      memset(&a, 0, sizeof(a));
+      switch (o.kind) {
+      case extent_protocol::TX_CREATE:
+        do_create(o.type, eid);
+        res.created.push_back(eid);
+        im->get_attr(local(eid), a);
+        break;
+      case extent_protocol::TX_PUT:
+        if (o.patch_at >= 0) {
+          extent_protocol::extentid_t n = res.created[o.patch_new];
+          memcpy(&o.data[o.patch_at], &n, sizeof(n));
+        }
+        r = do_put(eid, o.data, a, &reservation);
+        break;
+      case extent_protocol::TX_WRITE_RANGE:
+        r = do_write_range(eid, o.off, o.data, a, &reservation);
+        break;
+      case extent_protocol::TX_REMOVE:
+        do_remove(eid);
+        break;
+      case extent_protocol::TX_DIR_ADD: {
+        extent_protocol::extentid_t t = o.target;
+        if (extent_protocol::is_new_inum(t))
+          t = res.created[t & ~extent_protocol::NEW_INUM];
+        r = do_dir_add(eid, o.data, t, a, &reservation);
+        break;
+      }
+      case extent_protocol::TX_DIR_REMOVE:
+        do_dir_remove(eid, o.data, a);
+        break;
+      }
+      res.attrs.push_back(a);
+    }
+    im->unreserve_blocks(reservation);
+  }
+
+  // the writes draw on what tx_check set aside, so none can find the
+  // disk full; r is only ever OK here
+  if (iflog && ++txid % 30 == 0)
+    do_checkpoint();
+
+  return r;
+}
+
 int extent_server::begin_tx(int, int &)
 {
   chfs_command cmd(chfs_command::CMD_BEGIN, txid);
@@ -158,8 +550,16 @@ int extent_server::checkpoint(int, int &)
   //调整checkpoint的频率
 
   if (txid % 30 == 0) {
-    _persister->checkpoint(im);
+    do_checkpoint();
   }
 
   return extent_protocol::OK;
 }
+
+// Waits out the logged mutations in flight, so the saved disk holds
+// everything the log being dropped held.
+void extent_server::do_checkpoint()
+{
+  std::unique_lock<std::shared_mutex> ck(ckpt_mtx);
+  _persister->checkpoint(im);
+}
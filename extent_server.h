@@ -5,6 +5,9 @@
 
 #include <string>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include "extent_protocol.h"
 
 #include "inode_manager.h"
@@ -26,20 +29,92 @@ class extent_server {
   inode_manager *im;
   chfs_persister *_persister;
 
+  // This server holds shard `shard` of nshards. Inums on the wire are
+  // global: local inum l here is global (l - 1) * nshards + shard + 1,
+  // so each shard allocates from its own inode table with no
+  // coordination, and with one shard the two are the same. Only shard
+  // 0's local inode 1 is the root; the other shards' go unused.
+  // An inum that would fall outside the inode table is local 0, which
+  // names no inode.
+  int shard, nshards;
+  uint32_t local(extent_protocol::extentid_t id) const {
+    extent_protocol::extentid_t l = (id - 1) / nshards + 1;
+    return id != 0 && l <= INODE_NUM ? (uint32_t) l : 0;
+  }
+  extent_protocol::extentid_t global(uint32_t l) const {
+    return (extent_protocol::extentid_t) (l - 1) * nshards + shard + 1;
+  }
+  bool owns(extent_protocol::extentid_t id) const {
+    return id != 0 && (int) ((id - 1) % nshards) == shard;
+  }
+
+  // Handlers run on the rpcs thread pool. Lock order is ckpt_mtx, then
+  // alloc_mtx, then inode locks in ascending inum order.
+  //
+  // Logged mutations hold ckpt_mtx shared from log append to apply, so
+  // a checkpoint never saves a disk that is missing a logged change.
+  std::shared_mutex ckpt_mtx;
+  // creates and removes change which inum the next create gets, so
+  // they reach the log in the order they allocate
+  std::mutex alloc_mtx;
+  // readers of an inode share its lock; writers hold it from log append
+  // to apply, so the log orders writes to one inode as they happened.
+  // One lock per local inode; slot 0 takes every inum that names none.
+  std::shared_mutex inode_locks[INODE_NUM + 1];
+  std::shared_mutex &ilock(extent_protocol::extentid_t id) {
+    return inode_locks[local(id)];
+  }
+
+  void do_create(uint32_t type, extent_protocol::extentid_t &id);
+  void do_get(extent_protocol::extentid_t id, std::string &);
+  int do_put(extent_protocol::extentid_t id, const std::string &,
+             extent_protocol::attr &, uint32_t *reservation);
+  int do_write_range(extent_protocol::extentid_t id, unsigned long long off,
+                     const std::string &, extent_protocol::attr &,
+                     uint32_t *reservation);
+  void do_remove(extent_protocol::extentid_t id);
+  int do_dir_add(extent_protocol::extentid_t dir, const std::string &name,
+                 extent_protocol::extentid_t ino, extent_protocol::attr &,
+                 uint32_t *reservation);
+  void do_dir_remove(extent_protocol::extentid_t dir, const std::string &name,
+                     extent_protocol::attr &);
+  void do_checkpoint();
+
+  static bool tx_valid(const std::vector<extent_protocol::tx_op> &);
+  int tx_check(const std::vector<extent_protocol::tx_op> &,
+               uint32_t &reservation);
+
  public:
   typedef unsigned long long txid_t;
-  txid_t txid = 0;
+  std::atomic<txid_t> txid{0};
 
-  extent_server();
+  extent_server(int shard = 0, int nshards = 1);
 
   int checkpoint(int, int &);
   int begin_tx(int, int &);
   int commit_tx(int, int &);
   int create(uint32_t type, bool iflog, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, bool iflog, int &);
+  int put(extent_protocol::extentid_t id, std::string, bool iflog,
+          extent_protocol::attr &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read_range(extent_protocol::extentid_t id, unsigned long long off,
+                 unsigned long long len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned long long off,
+                  std::string buf, bool iflog, extent_protocol::attr &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+  int get_with_attr(extent_protocol::extentid_t id, extent_protocol::attr_data &);
+  int readdirplus(extent_protocol::extentid_t id,
+                  std::vector<extent_protocol::dirent> &);
   int remove(extent_protocol::extentid_t id, bool iflog, int &);
+  int exec_tx(std::vector<extent_protocol::tx_op> ops, bool iflog,
+              extent_protocol::tx_result &);
+  int dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                 extent_protocol::extentid_t &);
+  int dir_add(extent_protocol::extentid_t dir, std::string name,
+              extent_protocol::extentid_t ino, int &);
+  int dir_remove(extent_protocol::extentid_t dir, std::string name, int &);
+  int dir_list(extent_protocol::extentid_t dir,
+               std::vector<extent_protocol::dentry> &);
 
   // Your code here for lab2A: add logging APIs
 };
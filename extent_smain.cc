@@ -12,8 +12,16 @@ main(int argc, char *argv[])
 {
   int count = 0;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // several extent servers each hold one shard of the inodes; clients
+  // list them, in shard order, in a file (see server_list.h)
+  if(argc != 2 && argc != 4){
+    fprintf(stderr, "Usage: %s port [shard nshards]\n", argv[0]);
+    exit(1);
+  }
+  int shard = argc == 4 ? atoi(argv[2]) : 0;
+  int nshards = argc == 4 ? atoi(argv[3]) : 1;
+  if (nshards < 1 || shard < 0 || shard >= nshards) {
+    fprintf(stderr, "%s: bad shard %d of %d\n", argv[0], shard, nshards);
     exit(1);
   }
 
@@ -25,11 +33,20 @@ main(int argc, char *argv[])
   }
 
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(shard, nshards);
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::get_with_attr, &ls, &extent_server::get_with_attr);
+  server.reg(extent_protocol::readdirplus, &ls, &extent_server::readdirplus);
+  server.reg(extent_protocol::exec_tx, &ls, &extent_server::exec_tx);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::dir_list, &ls, &extent_server::dir_list);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
 
@@ -0,0 +1,174 @@
+//
+// Extent server tester: runs an extent_server in this process, on a
+// scratch log directory, and checks what its handlers leave on disk.
+//
+
+#include "extent_server.h"
+#include "inode_manager.h"
+#include "lang/verify.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef extent_protocol P;
+
+// the server's inode_manager, for checking what is allocated
+class test_server : public extent_server {
+ public:
+  inode_manager *inodes() { return im; }
+};
+
+// a server on an empty disk and an empty log
+test_server *
+fresh_server()
+{
+  unlink("log/logdata.bin");
+  unlink("log/checkpoint.bin");
+  return new test_server();
+}
+
+void
+fail(const char *what)
+{
+  fprintf(stderr, "error: %s\n", what);
+  fprintf(stdout, "error: %s\n", what);
+  exit(1);
+}
+
+// Fill the disk with files of chunk bytes, entered in the root as
+// prefix0, prefix1, ..., until a put no longer fits.
+void
+fill_disk(test_server *es, const std::string &prefix, size_t chunk)
+{
+  std::string data(chunk, 'f');
+  for (int i = 0; ; i++) {
+    P::tx_result res;
+    std::string name = prefix + std::to_string(i);
+    int r = es->exec_tx({P::tx_op::create(P::T_FILE),
+                         P::tx_op::put(P::new_inum(0), data),
+                         P::tx_op::dir_add(1, name, P::new_inum(0))},
+                        true, res);
+    if (r == P::IOERR)
+      return;
+    if (r != P::OK)
+      fail("filling the disk");
+  }
+}
+
+// test1: on a full disk, a transaction that creates a file and cannot
+// store its contents fails whole: no inode allocated, no entry made,
+// and the log replays to the same state.
+void
+test1(void)
+{
+  printf("test1: a create that does not fit leaves nothing behind\n");
+  test_server *es = fresh_server();
+  fill_disk(es, "big", 1024 * 1024);
+  // room for a small file, none for a big one
+  fill_disk(es, "small", 4 * BLOCK_SIZE);
+
+  uint32_t ninodes = es->inodes()->free_inodes();
+  std::string big(64 * BLOCK_SIZE, 'b');
+  P::tx_result res;
+  if (es->exec_tx({P::tx_op::create(P::T_FILE),
+                   P::tx_op::put(P::new_inum(0), big),
+                   P::tx_op::dir_add(1, "huge", P::new_inum(0))},
+                  true, res) != P::IOERR)
+    fail("a create larger than the free space succeeded");
+  if (!res.created.empty())
+    fail("a failed transaction reported a created inode");
+  if (es->inodes()->free_inodes() != ninodes)
+    fail("a failed transaction left an inode allocated");
+  P::extentid_t ino;
+  if (es->dir_lookup(1, "huge", ino) != P::NOENT)
+    fail("a failed transaction left an entry");
+
+  // an empty file still fits, and takes exactly one inode
+  if (es->exec_tx({P::tx_op::create(P::T_FILE),
+                   P::tx_op::dir_add(1, "empty", P::new_inum(0))},
+                  true, res) != P::OK)
+    fail("an empty create failed on a full disk");
+  if (es->inodes()->free_inodes() != ninodes - 1)
+    fail("an empty create took other than one inode");
+
+  // the replayed log agrees
+  std::vector<P::dentry> before, after;
+  es->dir_list(1, before);
+  test_server *again = new test_server();
+  again->dir_list(1, after);
+  if (after.size() != before.size() || again->dir_lookup(1, "huge", ino) != P::NOENT)
+    fail("the log replays to another directory");
+  if (again->inodes()->free_inodes() != ninodes - 1)
+    fail("the log replays to other inodes");
+  printf("test1: passed\n");
+}
+
+// test2: readdirplus returns each entry with the attributes getattr
+// gives for it, which the client takes as its own for entries it holds.
+void
+test2(void)
+{
+  printf("test2: readdirplus attributes match getattr\n");
+  test_server *es = fresh_server();
+  P::tx_result res;
+  for (int i = 0; i < 20; i++) {
+    std::string name = "f" + std::to_string(i);
+    if (es->exec_tx({P::tx_op::create(i % 2 ? P::T_DIR : P::T_FILE),
+                     P::tx_op::put(P::new_inum(0), std::string(i * 100, 'x')),
+                     P::tx_op::dir_add(1, name, P::new_inum(0))},
+                    true, res) != P::OK)
+      fail("creating the entries");
+  }
+
+  std::vector<P::dirent> ents;
+  if (es->readdirplus(1, ents) != P::OK || ents.size() != 20)
+    fail("readdirplus lost entries");
+  for (size_t i = 0; i < ents.size(); i++) {
+    P::attr a;
+    P::extentid_t ino;
+    if (es->dir_lookup(1, ents[i].name, ino) != P::OK || ino != ents[i].inum)
+      fail("readdirplus returned another inum");
+    if (es->getattr(ents[i].inum, a) != P::OK)
+      fail("getattr of a listed entry");
+    if (ents[i].a.type != a.type || ents[i].a.size != a.size ||
+        ents[i].a.mtime != a.mtime || ents[i].a.ctime != a.ctime)
+      fail("readdirplus attributes differ from getattr");
+  }
+  printf("test2: passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int test = 0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [test]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 1) {
+    test = atoi(argv[1]);
+    if (test < 1 || test > 2) {
+      printf("Test number must be between 1 and 2\n");
+      exit(1);
+    }
+  }
+
+  // the server keeps its log in ./log; use a scratch directory for it
+  char dir[] = "/tmp/extent_tester.XXXXXX";
+  VERIFY(mkdtemp(dir) != NULL);
+  VERIFY(chdir(dir) == 0);
+  VERIFY(mkdir("log", 0777) == 0);
+
+  if (!test || test == 1)
+    test1();
+  if (!test || test == 2)
+    test2();
+
+  printf("%s: passed all tests successfully\n", argv[0]);
+}
@@ -17,6 +17,7 @@
 #include <arpa/inet.h>
 #include "lang/verify.h"
 #include "chfs_client.h"
+#include "tlog.h"
 
 int myid;
 chfs_client *chfs;
@@ -45,8 +46,9 @@ getattr(chfs_client::inum inum, struct stat &st)
     bzero(&st, sizeof(st));
 
     st.st_ino = inum;
-    printf("getattr %016llx %d\n", inum, chfs->isfile(inum));
-    if(chfs->isfile(inum)){
+    bool isfile = chfs->isfile(inum);
+    tlog_debug("getattr %016llx %d\n", inum, isfile);
+    if(isfile){
         chfs_client::fileinfo info;
         ret = chfs->getfile(inum, info);
         if(ret != chfs_client::OK)
@@ -57,7 +59,7 @@ getattr(chfs_client::inum inum, struct stat &st)
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
+        tlog_debug("   getattr -> %llu\n", info.size);
     } else if (chfs->isdir(inum)) {
         chfs_client::dirinfo info;
         ret = chfs->getdir(inum, info);
@@ -68,7 +70,7 @@ getattr(chfs_client::inum inum, struct stat &st)
         st.st_atime = info.atime;
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
+        tlog_debug("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
     } else {
         chfs_client::fileinfo info;
         ret = chfs->getfile(inum, info);
@@ -80,7 +82,7 @@ getattr(chfs_client::inum inum, struct stat &st)
         st.st_mtime = info.mtime;
         st.st_ctime = info.ctime;
         st.st_size = info.size;
-        printf("   getattr -> %llu\n", info.size);
+        tlog_debug("   getattr -> %llu\n", info.size);
     }
     return chfs_client::OK;
 }
@@ -133,10 +135,13 @@ void
 fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         int to_set, struct fuse_file_info *fi)
 {
-    printf("fuseserver_setattr 0x%x\n", to_set);
+    tlog_debug("fuseserver_setattr 0x%x\n", to_set);
     if (FUSE_SET_ATTR_SIZE & to_set) {
-        printf("   fuseserver_setattr set size to %zu\n", attr->st_size);
-        chfs->setattr(ino, attr->st_size);
+        tlog_debug("   fuseserver_setattr set size to %zu\n", attr->st_size);
+        if (chfs->setattr(ino, attr->st_size) != chfs_client::OK) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
 
 #if 1
     struct stat st;
@@ -210,6 +215,26 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
     }
 }
 
+//
+// Writes may still be on their way to the server when write replies.
+// close (flush) and fsync wait for them, and fail with EIO if any did.
+//
+void
+fuseserver_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (chfs->fsync(ino) != chfs_client::OK)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_err(req, 0);
+}
+
+void
+fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    fuseserver_flush(req, ino, fi);
+}
+
 //
 // Create file @name in directory @parent. 
 //
@@ -258,7 +283,7 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     chfs_client::status ret;
     if( (ret = fuseserver_createhelper( parent, name, mode, &e, extent_protocol::T_FILE)) == chfs_client::OK ) {
         fuse_reply_create(req, &e, fi);
-        printf("OK: create returns.\n");
+        tlog_debug("OK: create returns.\n");
     } else {
         if (ret == chfs_client::EXIST) {
             fuse_reply_err(req, EEXIST);
@@ -317,7 +342,9 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+// type, if known, tells ls and find what the entry is without a stat
+void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino,
+        uint32_t type = 0)
 {
     struct stat stbuf;
     size_t oldsize = b->size;
@@ -325,6 +352,12 @@ void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
     b->p = (char *) realloc(b->p, b->size);
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
+    if (type == extent_protocol::T_DIR)
+        stbuf.st_mode = S_IFDIR;
+    else if (type == extent_protocol::T_FILE)
+        stbuf.st_mode = S_IFREG;
+    else if (type == extent_protocol::T_LINK)
+        stbuf.st_mode = S_IFLNK;
     fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
 }
 
@@ -355,7 +388,7 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     chfs_client::inum inum = ino; // req->in.h.nodeid;
     struct dirbuf b;
 
-    printf("fuseserver_readdir\n");
+    tlog_debug("fuseserver_readdir\n");
 
     if(!chfs->isdir(inum)){
         fuse_reply_err(req, ENOTDIR);
@@ -367,7 +400,7 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     std::list<chfs_client::dirent> entries;
     chfs->readdir(inum, entries);
     for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum, it->type);
     }
 
     reply_buf_limited(req, b.p, b.size, off, size);
@@ -453,8 +486,7 @@ fuseserver_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const ch
         getattr(inum, e.attr);
         fuse_reply_entry(req, &e);
     } else {
-        std::cout << "*********" << std::endl;
-        std::cout << r << std::endl;
+        tlog_err("fuseserver_symlink: symlink failed %d\n", r);
         fuse_reply_err(req, EPERM);
     }
 }
@@ -477,7 +509,7 @@ fuseserver_statfs(fuse_req_t req)
 {
     struct statvfs buf;
 
-    printf("statfs\n");
+    tlog_debug("statfs\n");
 
     memset(&buf, 0, sizeof(buf));
 
@@ -527,6 +559,8 @@ main(int argc, char *argv[])
     fuseserver_oper.open       = fuseserver_open;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.fsync      = fuseserver_fsync;
     fuseserver_oper.setattr    = fuseserver_setattr;
     fuseserver_oper.unlink     = fuseserver_unlink;
     fuseserver_oper.mkdir      = fuseserver_mkdir;
@@ -594,6 +628,7 @@ main(int argc, char *argv[])
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
+    delete chfs;
 
     return err ? 1 : 0;
 }
@@ -1,5 +1,7 @@
 #include "inode_manager.h"
+#include "tlog.h"
 #include <fstream>
+#include <algorithm>
 
 // disk layer -----------------------------------------
 
@@ -11,23 +13,31 @@ disk::disk()
 void
 disk::read_block(blockid_t id, char *buf)
 {
-  for (int i = 0; i < BLOCK_SIZE; ++i) {
-    buf[i] = blocks[id][i];
-  }
+  memcpy(buf, blocks[id], BLOCK_SIZE);
 }
 
 void
 disk::write_block(blockid_t id, const char *buf)
 {
-  for (int i = 0; i < BLOCK_SIZE; ++i) {
-    blocks[id][i] = buf[i];
-  }
+  memcpy(blocks[id], buf, BLOCK_SIZE);
+}
+
+void
+disk::read_blocks(blockid_t id, int n, char *buf)
+{
+  memcpy(buf, blocks[id], (size_t) n * BLOCK_SIZE);
+}
+
+void
+disk::write_blocks(blockid_t id, int n, const char *buf)
+{
+  memcpy(blocks[id], buf, (size_t) n * BLOCK_SIZE);
 }
 
 // block layer -----------------------------------------
 
 bool
-block_manager::isfree_block(blockid_t blockid, char *buf)
+block_manager::isfree_block(blockid_t blockid, const char *buf)
 {
   blockid_t bit_id = blockid % BPB;
   if ((buf[bit_id / 8] >> (7 - (bit_id % 8))) & 0x01) {
@@ -52,50 +62,208 @@ block_manager::freebit_block(blockid_t blockid, char *buf)
 }
 
 
-// Allocate a free disk block.
-blockid_t
-block_manager::alloc_block()
+// The first data block; DATA_BLOCK0 is not parenthesized.
+static const blockid_t data_block0 = DATA_BLOCK0;
+// How far alloc_blocks looks for a run of the full length once it has
+// found any free block, so a fragmented disk costs a bounded search
+// rather than a scan of all of it.
+static const long run_search = 16 * 64;   // sixteen words of bitmap
+
+// Set (inuse) or clear the bits of blocks [start, start+n), in memory
+// and on disk. The caller holds bitmap_mtx.
+void
+block_manager::mark_blocks(blockid_t start, int n, bool inuse)
 {
-  /*
-   * your code goes here.
-   * note: you should mark the corresponding bit in block bitmap when alloc.
-   * you need to think about which block you can start to be allocated.
-   */
   char buf[BLOCK_SIZE];
-  blockid_t bitblock = 0, block_id = 0;
-
-  for (int i = DATA_BLOCK0; i < BLOCK_NUM; ++i) {
-    if (bitblock != BBLOCK(i)) {
-      bitblock = BBLOCK(i);
+  blockid_t bitblock = 0;
+  for (blockid_t id = start; id < start + n; ++id) {
+    if (BBLOCK(id) != bitblock) {
+      if (bitblock)
+        write_block(bitblock, buf);
+      bitblock = BBLOCK(id);
       read_block(bitblock, buf);
     }
-    if (isfree_block(i, buf)) {
-      block_id = i;
-      setbit_block(i, buf);
-      write_block(bitblock, buf);
+    uint64_t bit = 1ULL << (id % 64);
+    if (inuse) {
+      used[id / 64] |= bit;
+      nfree[id / BPB]--;
+      free_total--;
+      setbit_block(id, buf);
+    } else {
+      used[id / 64] &= ~bit;
+      nfree[id / BPB]++;
+      free_total++;
+      freebit_block(id, buf);
+    }
+  }
+  if (bitblock)
+    write_block(bitblock, buf);
+}
+
+// How many blocks from id on are free, up to max.
+int
+block_manager::free_run(blockid_t id, int max)
+{
+  int len = 0;
+  while (len < max && id + len < BLOCK_NUM) {
+    blockid_t b = id + len;
+    uint64_t u = used[b / 64] >> (b % 64);
+    if (u & 1)
       break;
+    // the free bits up to the next used one in this word
+    len += u ? __builtin_ctzll(u) : 64 - b % 64;
+  }
+  return len < max ? len : max;
+}
+
+// Look in [from, to) for a free run of n; a run may go on past to. If
+// there is none, best and best_len are the longest seen so far. Gives
+// up once budget blocks have been passed with some free block in hand.
+int
+block_manager::find_run(blockid_t from, blockid_t to, int n, blockid_t &start,
+                        blockid_t &best, int &best_len, long &budget)
+{
+  blockid_t id = from, last = from;
+  while (id < to) {
+    budget -= id - last;
+    last = id;
+    if (best_len > 0 && budget <= 0)
+      return 0;
+    if (id % BPB == 0 && nfree[id / BPB] == 0) {
+      id += BPB;
+      continue;
+    }
+    uint64_t f = ~used[id / 64] >> (id % 64);
+    if (f == 0) {
+      id = (id / 64 + 1) * 64;
+      continue;
+    }
+    id += __builtin_ctzll(f);
+    if (id >= to)
+      break;
+    int len = free_run(id, n);
+    if (len == n) {
+      start = id;
+      return n;
+    }
+    if (len > best_len) {
+      best = id;
+      best_len = len;
     }
+    id += len;
   }
-  // std::cout << "alloc blockid: " << block_id << std::endl;
+  return 0;
+}
+
+// Next fit: look from where the last allocation ended, then wrap
+// around, so successive allocations come out in a row and no call
+// rescans the full start of the disk. Whole bitmap blocks with nothing
+// free and whole words in use are each passed in one step.
+int
+block_manager::alloc_blocks(int n, blockid_t &start, uint32_t *reservation)
+{
+  if (n < 1)
+    n = 1;
+  blockid_t best = 0;
+  int best_len = 0;
+  long budget = run_search;
+
+  std::lock_guard<std::mutex> l(bitmap_mtx);
+  uint32_t mine = reservation ? *reservation : 0;
+  uint32_t avail = free_total - reserved + mine;
+  if (avail == 0)
+    return -1;
+  if ((uint32_t) n > avail)
+    n = avail;
+  int got = find_run(cursor, BLOCK_NUM, n, start, best, best_len, budget);
+  if (got == 0 && (best_len == 0 || budget > 0))
+    got = find_run(data_block0, cursor, n, start, best, best_len, budget);
+  if (got == 0) {
+    if (best_len == 0)
+      return -1;
+    start = best;
+    got = best_len;
+  }
+  mark_blocks(start, got, true);
+  cursor = start + got < BLOCK_NUM ? start + got : data_block0;
+  uint32_t drawn = std::min((uint32_t) got, mine);
+  if (reservation)
+    *reservation -= drawn;
+  reserved -= drawn;
+  return got;
+}
 
-  return block_id;
+// Allocate a free disk block.
+bool
+block_manager::alloc_block(blockid_t &id)
+{
+  return alloc_blocks(1, id) == 1;
 }
 
 void
 block_manager::free_block(uint32_t id)
 {
-  /* 
-   * your code goes here.
-   * note: you should unmark the corresponding bit in the block bitmap when free.
-   */
-//需不需要判断block已经是free的情况？
+  free_blocks(id, 1);
+}
 
-  char buf[BLOCK_SIZE];
-  read_block(BBLOCK(id), buf);
-  freebit_block(id, buf);
-  write_block(BBLOCK(id), buf);
-  
-  return;
+// Free blocks [start, start+n); ones already free or outside the data
+// are left alone.
+void
+block_manager::free_blocks(blockid_t start, int n, uint32_t *reservation)
+{
+  std::lock_guard<std::mutex> l(bitmap_mtx);
+  uint32_t before = free_total;
+  blockid_t run = start;
+  for (blockid_t id = start; id <= start + n; ++id) {
+    bool ok = id < start + n && id >= data_block0 && id < BLOCK_NUM &&
+      (used[id / 64] & (1ULL << (id % 64)));
+    if (ok)
+      continue;
+    if (id > run)
+      mark_blocks(run, id - run, false);
+    run = id + 1;
+  }
+  if (reservation) {
+    *reservation += free_total - before;
+    reserved += free_total - before;
+  }
+}
+
+bool
+block_manager::reserve(uint32_t n)
+{
+  std::lock_guard<std::mutex> l(bitmap_mtx);
+  if (free_total - reserved < n)
+    return false;
+  reserved += n;
+  return true;
+}
+
+void
+block_manager::unreserve(uint32_t n)
+{
+  std::lock_guard<std::mutex> l(bitmap_mtx);
+  reserved -= std::min(n, reserved);
+}
+
+// Read the bitmap blocks into used and nfree. Nothing is reserved: no
+// writer is under way while the disk is loaded.
+void
+block_manager::load_free_map()
+{
+  used.assign(BLOCK_NUM / 64, 0);
+  nfree.assign(BLOCK_NUM / BPB, 0);
+  free_total = 0;
+  for (blockid_t id = 0; id < BLOCK_NUM; ++id) {
+    if (id < data_block0 || !isfree_block(id, view_block(BBLOCK(id)))) {
+      used[id / 64] |= 1ULL << (id % 64);
+    } else {
+      nfree[id / BPB]++;
+      free_total++;
+    }
+  }
+  reserved = 0;
+  cursor = data_block0;
 }
 
 // The layout of disk should be like this:
@@ -108,6 +276,7 @@ block_manager::block_manager()
   sb.size = BLOCK_SIZE * BLOCK_NUM;
   sb.nblocks = BLOCK_NUM;
   sb.ninodes = INODE_NUM;
+  load_free_map();
 
 }
 
@@ -125,11 +294,36 @@ block_manager::write_block(uint32_t id, const char *buf)
   d->write_block(id, buf);
 }
 
+void
+block_manager::read_blocks(const blockid_t *ids, int n, char *buf)
+{
+  for (int i = 0; i < n; ) {
+    int run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+      ++run;
+    d->read_blocks(ids[i], run, buf + (size_t) i * BLOCK_SIZE);
+    i += run;
+  }
+}
+
+void
+block_manager::write_blocks(const blockid_t *ids, int n, const char *buf)
+{
+  for (int i = 0; i < n; ) {
+    int run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+      ++run;
+    d->write_blocks(ids[i], run, buf + (size_t) i * BLOCK_SIZE);
+    i += run;
+  }
+}
+
 // inode layer -----------------------------------------
 
 inode_manager::inode_manager()
 {
   bm = new block_manager();
+  load_free_inodes();
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
@@ -137,15 +331,181 @@ inode_manager::inode_manager()
   }
 }
 
-blockid_t
-inode_manager::indirect_blockid(int index, char *buf)
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+static_assert(sizeof(overflow_block_t) <= BLOCK_SIZE,
+              "an overflow block fits in a block");
+static_assert(INODE_NUM % 64 == 0 && INODE_NUM / 64 <= 64,
+              "ifree_words has a bit per word of ifree");
+
+// All the extents of ino, following its overflow chain.
+void
+inode_manager::get_extents(const struct inode *ino, std::vector<extent> &ext)
 {
-  return *(blockid_t *)(buf + (index - NDIRECT)*sizeof(uint));
+  ext.assign(ino->ext, ino->ext + MIN(ino->nextent, (uint32_t) NEXTENT));
+  blockid_t b = ino->overflow;
+  while (ext.size() < ino->nextent && b != 0) {
+    const overflow_block_t *ob = (const overflow_block_t *) bm->view_block(b);
+    size_t n = MIN(ino->nextent - ext.size(), EPB);
+    ext.insert(ext.end(), ob->ext, ob->ext + n);
+    b = ob->next;
+  }
 }
+
+// Make ext the extents of ino: the first NEXTENT in the inode and the
+// rest in its overflow chain. The chain keeps the blocks it has and
+// takes or gives back blocks at its end; only blocks whose contents
+// change are written. The caller puts the inode. False, with ino and
+// its chain as they were, if the chain needs blocks the disk lacks.
+bool
+inode_manager::put_extents(struct inode *ino, const std::vector<extent> &ext,
+                           uint32_t *reservation)
+{
+  size_t here = MIN(ext.size(), (size_t) NEXTENT);
+  std::vector<blockid_t> chain;
+  for (blockid_t b = ino->overflow; b != 0;
+       b = ((const overflow_block_t *) bm->view_block(b))->next)
+    chain.push_back(b);
+  size_t need = (ext.size() - here + EPB - 1) / EPB;
+  if (chain.size() < need) {
+    size_t have = chain.size();
+    chain.resize(need);
+    if (!alloc_blocks(&chain[have], need - have, reservation))
+      return false;
+  }
+  while (chain.size() > need) {
+    bm->free_blocks(chain.back(), 1, reservation);
+    chain.pop_back();
+  }
+
+  std::copy(ext.begin(), ext.begin() + here, ino->ext);
+  ino->nextent = ext.size();
+
+  blockid_t raw[BLOCK_SIZE / sizeof(blockid_t)];
+  overflow_block_t *ob = (overflow_block_t *) raw;
+  for (size_t k = 0; k < need; ++k) {
+    size_t i = here + k * EPB;
+    size_t n = MIN(ext.size() - i, EPB);
+    bzero(raw, BLOCK_SIZE);
+    ob->next = k + 1 < need ? chain[k + 1] : 0;
+    std::copy(ext.begin() + i, ext.begin() + i + n, ob->ext);
+    if (memcmp(raw, bm->view_block(chain[k]), BLOCK_SIZE) != 0)
+      bm->write_block(chain[k], (const char *) raw);
+  }
+  ino->overflow = need ? chain[0] : 0;
+  return true;
+}
+
+// The disk blocks of file blocks [first, first+n), which must exist.
 void
-inode_manager::set_indirect_blockid(int index, blockid_t newid, char *buf)
+inode_manager::map_blocks(const std::vector<extent> &ext, int first, int n,
+                          blockid_t *ids)
 {
-  *(blockid_t *)(buf + (index - NDIRECT)*sizeof(uint)) = newid;
+  int pos = 0;   // file block at which the current extent starts
+  for (size_t e = 0; e < ext.size() && n > 0; pos += ext[e].len, ++e) {
+    if (first >= pos + (int) ext[e].len)
+      continue;
+    for (int k = first - pos; k < (int) ext[e].len && n > 0; ++k, --n) {
+      *ids++ = ext[e].start + k;
+      ++first;
+    }
+  }
+}
+
+// Append ids[0..n) to the end of the file's blocks, growing the last
+// extent when they follow on from it.
+void
+inode_manager::add_blocks(std::vector<extent> &ext, const blockid_t *ids,
+                          int n)
+{
+  for (int i = 0; i < n; ++i) {
+    if (!ext.empty() && ext.back().start + ext.back().len == ids[i]) {
+      ext.back().len++;
+    } else {
+      extent e = { ids[i], 1 };
+      ext.push_back(e);
+    }
+  }
+}
+
+// Keep the first nblocks blocks of the file and free the rest.
+void
+inode_manager::cut_blocks(std::vector<extent> &ext, int nblocks)
+{
+  int pos = 0;
+  size_t e = 0;
+  for (; e < ext.size() && pos + (int) ext[e].len <= nblocks; ++e)
+    pos += ext[e].len;
+  if (e < ext.size() && pos < nblocks) {
+    int keep = nblocks - pos;
+    bm->free_blocks(ext[e].start + keep, ext[e].len - keep);
+    ext[e].len = keep;
+    ++e;
+  }
+  for (size_t f = e; f < ext.size(); ++f)
+    bm->free_blocks(ext[f].start, ext[f].len);
+  ext.resize(e);
+}
+
+// Fill ids[0..n) with new blocks, in as few runs as free space allows.
+// False, with none of them kept, if the disk runs out first.
+bool
+inode_manager::alloc_blocks(blockid_t *ids, int n, uint32_t *reservation)
+{
+  for (int i = 0; i < n; ) {
+    blockid_t start;
+    int got = bm->alloc_blocks(n - i, start, reservation);
+    if (got < 0) {
+      free_ids(ids, i, reservation);
+      return false;
+    }
+    for (int k = 0; k < got; ++k)
+      ids[i++] = start + k;
+  }
+  return true;
+}
+
+// Give back blocks ids[0..n), a run at a time.
+void
+inode_manager::free_ids(const blockid_t *ids, int n, uint32_t *reservation)
+{
+  for (int i = 0; i < n; ) {
+    int run = 1;
+    while (i + run < n && ids[i + run] == ids[i] + run)
+      ++run;
+    bm->free_blocks(ids[i], run, reservation);
+    i += run;
+  }
+}
+
+// Find the free inodes, those of type 0, in the inode table.
+void
+inode_manager::load_free_inodes()
+{
+  std::lock_guard<std::mutex> l(itable_mtx);
+  bzero(ifree, sizeof(ifree));
+  ifree_words = 0;
+  for (uint32_t i = 1; i <= INODE_NUM; ++i) {
+    const inode_t *ino =
+      (const inode_t *) bm->view_block(IBLOCK(i, bm->sb.nblocks)) + i%IPB;
+    if (ino->type == 0)
+      set_inode_free(i, true);
+  }
+}
+
+void
+inode_manager::set_inode_free(uint32_t inum, bool free)
+{
+  int w = (inum - 1) / 64;
+  uint64_t bit = 1ULL << ((inum - 1) % 64);
+  if (free) {
+    ifree[w] |= bit;
+    ifree_words |= 1ULL << w;
+  } else {
+    ifree[w] &= ~bit;
+    if (ifree[w] == 0)
+      ifree_words &= ~(1ULL << w);
+  }
 }
 
 /* Create a new file.
@@ -158,32 +518,20 @@ inode_manager::alloc_inode(uint32_t type)
    * note: the normal inode block should begin from the 2nd inode block.
    * the 1st is used for root_dir, see inode_manager::inode_manager().
    */
-  char buf[BLOCK_SIZE];
-  blockid_t block_id = 0, bitblock = 0;
   uint32_t inode_id = 0;
 
-  for (int i = 1; i <= INODE_NUM; ++i) {
-    block_id = IBLOCK(i, bm->sb.nblocks);
+  // the lowest free inode, as the old scan from 1 gave
+  std::lock_guard<std::mutex> l(itable_mtx);
+  if (ifree_words != 0) {
+    int w = __builtin_ctzll(ifree_words);
+    inode_id = w * 64 + __builtin_ctzll(ifree[w]) + 1;
+    set_inode_free(inode_id, false);
 
-    if (BBLOCK(block_id) != bitblock) {
-      bitblock = BBLOCK(block_id);
-      bm->read_block(bitblock, buf);
-    }
-    // std::cout << "if inode bit free: " << bm->isfree_block(block_id, buf) << std::endl;
-    if (bm->isfree_block(block_id, buf)) {
-      inode_id = i;
-      bm->setbit_block(block_id, buf);
-      bm->write_block(bitblock, buf);
-      break;
-    }
-  }
-
-
-  if (inode_id) {
     inode_t inode;
+    bzero(&inode, sizeof(inode));
     inode.type = type;
-    inode.size = 0;
-    put_inode(inode_id, &inode);
+    inode.atime = inode.mtime = inode.ctime = time(0);
+    write_inode(inode_id, &inode);
   }
 
   return inode_id;
@@ -198,38 +546,55 @@ inode_manager::free_inode(uint32_t inum)
    * if not, clear it, and remember to write back to disk.
    */
 
-  blockid_t block_id = IBLOCK(inum, bm->sb.nblocks);
-  char buf[BLOCK_SIZE];
-  bm->read_block(BBLOCK(block_id), buf);
+  if (inum < 1 || inum > INODE_NUM)
+    return;
+  std::lock_guard<std::mutex> l(itable_mtx);
+  if (inode_free(inum)) return;
 
-  if (bm->isfree_block(block_id, buf)) return;
-  else {
-    bm->freebit_block(block_id, buf);
-    bm->write_block(BBLOCK(block_id), buf);
-  }
-  // std::cout << "free inode:\n";
-  // std::cout << "if inode bit free: " << bm->isfree_block(block_id, buf) << std::endl;
+  inode_t inode;
+  bzero(&inode, sizeof(inode));
+  write_inode(inum, &inode);
+  set_inode_free(inum, true);
+}
 
-  return;
+uint32_t
+inode_manager::free_inodes()
+{
+  std::lock_guard<std::mutex> l(itable_mtx);
+  uint32_t n = 0;
+  for (int w = 0; w < INODE_NUM / 64; w++)
+    n += __builtin_popcountll(ifree[w]);
+  return n;
+}
+
+bool
+inode_manager::reserve_blocks(uint32_t n)
+{
+  return bm->reserve(n);
+}
+
+void
+inode_manager::unreserve_blocks(uint32_t n)
+{
+  bm->unreserve(n);
 }
 
 
 /* Return an inode structure by inum, NULL otherwise.
  * Caller should release the memory. */
-//什么情况下会返回null? 这个函数需要检查inode是否为free吗？
 struct inode* 
 inode_manager::get_inode(uint32_t inum)
 {
-  blockid_t bitblock_id = IBLOCK(inum, bm->sb.nblocks);
-  char bitblock[BLOCK_SIZE];
-  bm->read_block(BBLOCK(bitblock_id), bitblock);
-  // std::cout << "if inode bit free: " << bm->isfree_block(bitblock_id, bitblock) << std::endl;
-  if (bm->isfree_block(bitblock_id, bitblock)) return nullptr;
+  if (inum < 1 || inum > INODE_NUM)
+    return nullptr;
+  std::lock_guard<std::mutex> l(itable_mtx);
+  if (inode_free(inum))
+    return nullptr;
 
-  struct inode *ino;
-  char *buf = new char [BLOCK_SIZE];
-  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
-  ino = (inode_t *)buf + inum%IPB;
+  // copy just the inode out of its block
+  struct inode *ino = new inode_t;
+  *ino = *((const inode_t *) bm->view_block(IBLOCK(inum, bm->sb.nblocks)) +
+           inum%IPB);
 
   return ino;
 }
@@ -237,137 +602,265 @@ inode_manager::get_inode(uint32_t inum)
 void
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
-  char buf[BLOCK_SIZE];
-  struct inode *ino_disk;
-
-  printf("\tim: put_inode %d\n", inum);
+  tlog_debug("\tim: put_inode %d\n", inum);
   if (ino == NULL)
     return;
 
+  std::lock_guard<std::mutex> l(itable_mtx);
+  write_inode(inum, ino);
+}
+
+// Write ino into its slot in the table; the caller holds itable_mtx.
+void
+inode_manager::write_inode(uint32_t inum, const struct inode *ino)
+{
+  char buf[BLOCK_SIZE];
+  struct inode *ino_disk;
+
   bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
   ino_disk = (struct inode*)buf + inum%IPB;
   *ino_disk = *ino;
   bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b))
-
-/* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
+/* Get all the data of a file by inum into buf. */
 void
-inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+inode_manager::read_file(uint32_t inum, std::string &buf)
 {
+  buf.clear();
   inode_t *ino = get_inode(inum);
-  *size = ino->size;
-  if (*size == 0) return;
+  if (ino == nullptr)
+    return;
 
-  int block_num = (ino->size - 1) / BLOCK_SIZE + 1;
+  // a copy per extent, straight into buf
+  int block_num = ino->size == 0 ? 0 : ((ino->size - 1) / BLOCK_SIZE + 1);
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+  std::vector<blockid_t> ids(block_num);
+  map_blocks(ext, 0, block_num, ids.data());
+  buf.resize((size_t) block_num * BLOCK_SIZE);
+  bm->read_blocks(ids.data(), block_num, &buf[0]);
+  buf.resize(ino->size);
 
-  (*buf_out) = new char [block_num * BLOCK_SIZE];
-  for (int i = 0; i < MIN(block_num, NDIRECT); ++i) {
-    bm->read_block(ino->blocks[i], (*buf_out)+i*BLOCK_SIZE);
-  }
+  ino->atime = time(0);
+  put_inode(inum, ino);
+  delete ino;
+}
+
+/* alloc/free blocks if needed */
+bool
+inode_manager::write_file(uint32_t inum, const char *buf, int size,
+                          uint32_t *reservation)
+{
+  inode_t *ino = get_inode(inum);
+  if (ino == nullptr)
+    return true;
+  if (size > MAXFILE * BLOCK_SIZE)
+    size = MAXFILE * BLOCK_SIZE;
+  int block_num = size == 0 ? 0 : ((size - 1) / BLOCK_SIZE + 1);
+  int old_block_num = ino->size == 0 ? 0 : ((ino->size - 1) / BLOCK_SIZE + 1);
 
-  char indirect_block[BLOCK_SIZE];
-  if (block_num > NDIRECT) {
-    bm->read_block(ino->blocks[NDIRECT], indirect_block);
-    // std::cout << "read indirect block: " << ino->blocks[NDIRECT] << std::endl;
-    for (int i = NDIRECT; i < block_num; ++i) {
-      bm->read_block(indirect_blockid(i, indirect_block), (*buf_out)+i*BLOCK_SIZE);
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+  if (block_num < old_block_num) {
+    cut_blocks(ext, block_num);
+    put_extents(ino, ext, reservation);
+  } else if (block_num > old_block_num) {
+    // the new blocks in as few runs as the disk allows
+    std::vector<blockid_t> fresh(block_num - old_block_num);
+    if (!alloc_blocks(fresh.data(), fresh.size(), reservation)) {
+      delete ino;
+      return false;
+    }
+    add_blocks(ext, fresh.data(), fresh.size());
+    if (!put_extents(ino, ext, reservation)) {
+      free_ids(fresh.data(), fresh.size(), reservation);
+      delete ino;
+      return false;
     }
   }
 
-  ino->atime = time(0);
+  // whole blocks straight from buf; the last one, if buf ends inside
+  // it, through a zeroed copy so nothing past size is read
+  std::vector<blockid_t> ids(block_num);
+  map_blocks(ext, 0, block_num, ids.data());
+  int whole = size / BLOCK_SIZE;
+  bm->write_blocks(ids.data(), whole, buf);
+  if (whole < block_num) {
+    char tail[BLOCK_SIZE];
+    bzero(tail, BLOCK_SIZE);
+    memcpy(tail, buf + whole * BLOCK_SIZE, size - whole * BLOCK_SIZE);
+    bm->write_block(ids[whole], tail);
+  }
+
+  ino->size = size;
+  ino->mtime = time(0);
+  ino->ctime = time(0);
   put_inode(inum, ino);
 
-  
-  /*
-   * your code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_out
-   */
   delete ino;
-  
-  return;
+  return true;
 }
 
-/* alloc/free blocks if needed */
+/* Read up to len bytes at off, touching only the blocks they span.
+ * Stops at the end of the file. */
 void
-inode_manager::write_file(uint32_t inum, const char *buf, int size)
+inode_manager::read_range(uint32_t inum, unsigned int off, unsigned int len,
+                          std::string &buf)
 {
+  buf.clear();
   inode_t *ino = get_inode(inum);
-  int block_num = size == 0 ? 0 : ((size - 1) / BLOCK_SIZE + 1);
+  if (ino == nullptr)
+    return;
+  if (off >= ino->size || len == 0) {
+    delete ino;
+    return;
+  }
+  if (len > ino->size - off)
+    len = ino->size - off;
+
+  // the bytes go from the disk straight into buf, one copy each
+  int first = off / BLOCK_SIZE;
+  int last = (off + len - 1) / BLOCK_SIZE;
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+  std::vector<blockid_t> ids(last - first + 1);
+  map_blocks(ext, first, ids.size(), ids.data());
+
+  buf.reserve(len);
+  for (int i = first; i <= last; ++i) {
+    const char *block = bm->view_block(ids[i - first]);
+    unsigned int from = i == first ? off % BLOCK_SIZE : 0;
+    unsigned int to = i == last ? (off + len - 1) % BLOCK_SIZE + 1 : BLOCK_SIZE;
+    buf.append(block + from, to - from);
+  }
 
+  ino->atime = time(0);
+  put_inode(inum, ino);
+  delete ino;
+}
 
-  //free blocks
-  char indirect_block[BLOCK_SIZE];
-  if (ino->size / BLOCK_SIZE + 1 > NDIRECT) {
-    // std::cout << "111\n";
-    bm->read_block(ino->blocks[NDIRECT], indirect_block);
+/* Write size bytes at off, reading and writing only the blocks they
+ * span. Writing past the end grows the file; any gap between the old
+ * end and off reads back as zeros. */
+bool
+inode_manager::write_range(uint32_t inum, unsigned int off, const char *buf,
+                           unsigned int size, uint32_t *reservation)
+{
+  inode_t *ino = get_inode(inum);
+  if (ino == nullptr)
+    return true;
+  if (off >= MAXFILE * BLOCK_SIZE) {
+    delete ino;
+    return true;
   }
-  int old_block_num = ino->size == 0 ? 0 : ((ino->size - 1) / BLOCK_SIZE + 1);
-  for (int i = block_num; i < old_block_num; ++i) {
-    // std::cout << "111\n";
-    if (i < NDIRECT) bm->free_block(ino->blocks[i]);
-    else bm->free_block(indirect_blockid(i, indirect_block));
+  if (size > MAXFILE * BLOCK_SIZE - off)
+    size = MAXFILE * BLOCK_SIZE - off;
+
+  unsigned int old_size = ino->size;
+  unsigned int new_size = off + size > old_size ? off + size : old_size;
+  int old_block_num = old_size == 0 ? 0 : ((old_size - 1) / BLOCK_SIZE + 1);
+  int block_num = new_size == 0 ? 0 : ((new_size - 1) / BLOCK_SIZE + 1);
+
+  char block[BLOCK_SIZE];
+  int first = off / BLOCK_SIZE;
+  int last = size == 0 ? first - 1 : (off + size - 1) / BLOCK_SIZE;
+
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+
+  // grow: new blocks may hold stale data, so any not wholly written
+  // below are zeroed, as is the old last block past the old end
+  bzero(block, BLOCK_SIZE);
+  if (block_num > old_block_num) {
+    std::vector<blockid_t> fresh(block_num - old_block_num);
+    if (!alloc_blocks(fresh.data(), fresh.size(), reservation)) {
+      delete ino;
+      return false;
+    }
+    add_blocks(ext, fresh.data(), fresh.size());
+    if (!put_extents(ino, ext, reservation)) {
+      free_ids(fresh.data(), fresh.size(), reservation);
+      delete ino;
+      return false;
+    }
+    for (int i = old_block_num; i < block_num; ++i) {
+      if (i < first || i > last)
+        bm->write_block(fresh[i - old_block_num], block);
+    }
   }
-  if (block_num <= NDIRECT && ino->size / BLOCK_SIZE + 1 > NDIRECT) {
-    // std::cout << "111\n";
-    bm->free_block(ino->blocks[NDIRECT]);
+  if (off > old_size && old_size % BLOCK_SIZE != 0 &&
+      (int) ((old_size - 1) / BLOCK_SIZE) < first) {
+    blockid_t b;
+    map_blocks(ext, old_block_num - 1, 1, &b);
+    bm->read_block(b, block);
+    bzero(block + old_size % BLOCK_SIZE, BLOCK_SIZE - old_size % BLOCK_SIZE);
+    bm->write_block(b, block);
   }
 
-  // std::cout << "after free\n";
-
-  
-
-  //direct blocks
-  for (int i = 0; i < MIN(block_num, NDIRECT); ++i) {
-    if (i * BLOCK_SIZE >= ino->size) {
-      blockid_t new_block = bm->alloc_block();
-      // std::cout << "new block id: " << new_block << std::endl;
-      ino->blocks[i] = new_block;
+  if (last >= first) {
+    std::vector<blockid_t> ids(last - first + 1);
+    map_blocks(ext, first, ids.size(), ids.data());
+
+    // the whole blocks go from buf in one call, a copy per extent
+    int wfirst = (off + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int wend = (off + size) / BLOCK_SIZE;
+    if (wend > wfirst)
+      bm->write_blocks(&ids[wfirst - first], wend - wfirst,
+                       buf + (wfirst * BLOCK_SIZE - off));
+
+    for (int i = first; i <= last; ++i) {
+      if (i >= wfirst && i < wend)
+        continue;
+      unsigned int from = i == first ? off % BLOCK_SIZE : 0;
+      unsigned int to = i == last ? (off + size - 1) % BLOCK_SIZE + 1 : BLOCK_SIZE;
+      blockid_t b = ids[i - first];
+      // partial block: keep what is there, up to the old end
+      if (i < old_block_num)
+        bm->read_block(b, block);
+      else
+        bzero(block, BLOCK_SIZE);
+      unsigned int valid = old_size > (unsigned int) i * BLOCK_SIZE ?
+        old_size - i * BLOCK_SIZE : 0;
+      if (valid < from)
+        bzero(block + valid, from - valid);
+      memcpy(block + from, buf + (i * BLOCK_SIZE + from - off), to - from);
+      bm->write_block(b, block);
     }
-    bm->write_block(ino->blocks[i], buf+i*BLOCK_SIZE);
-    // std::cout << "write block id: " << ino->blocks[i] << std::endl;
   }
 
-  // std::cout << "after direct\n";
+  ino->size = new_size;
+  ino->mtime = time(0);
+  ino->ctime = time(0);
+  put_inode(inum, ino);
+  delete ino;
+  return true;
+}
 
-  //indirect blocks
-  if (block_num > NDIRECT) {
-    // std::cout << "indirect block used\n";
-    if (ino->size <= NDIRECT * BLOCK_SIZE) {
-      ino->blocks[NDIRECT] = bm->alloc_block();
-    }
-    char indirect_block[BLOCK_SIZE];
-    bm->read_block(ino->blocks[NDIRECT], indirect_block);
-    for (int i = NDIRECT; i < block_num; ++i) {
-      if (i * BLOCK_SIZE >= ino->size) {
-        blockid_t new_block = bm->alloc_block();
-        set_indirect_blockid(i, new_block, indirect_block);
-      }
-      bm->write_block(indirect_blockid(i, indirect_block), buf+i*BLOCK_SIZE);
-    }
-    bm->write_block(ino->blocks[NDIRECT], indirect_block);
+/* Cut the file back to size bytes, freeing the blocks past the new
+ * end. Does nothing if the file is no bigger than that. */
+void
+inode_manager::truncate(uint32_t inum, unsigned int size)
+{
+  inode_t *ino = get_inode(inum);
+  if (ino == nullptr)
+    return;
+  if (size >= ino->size) {
+    delete ino;
+    return;
   }
-  // std::cout << "after indirect\n";
+
+  int block_num = size == 0 ? 0 : ((size - 1) / BLOCK_SIZE + 1);
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+  cut_blocks(ext, block_num);
+  put_extents(ino, ext, NULL);   // fewer extents: the chain only shrinks
 
   ino->size = size;
   ino->mtime = time(0);
   ino->ctime = time(0);
-  // std::cout << "mtime: " << time(0) << std::endl;
   put_inode(inum, ino);
-
   delete ino;
-  
-  /*
-   * your code goes here.
-   * note: write buf to blocks of inode inum.
-   * you need to consider the situation when the size of buf 
-   * is larger or smaller than the size of original inode
-   */
-  
-  return;
 }
 
 void
@@ -403,27 +896,17 @@ inode_manager::remove_file(uint32_t inum)
    * note: you need to consider about both the data block and inode of the file
    */
   inode_t *ino = get_inode(inum);
-  int block_num = (ino->size == 0 ? 0 : ino->size - 1) / BLOCK_SIZE + 1;
-
-  //free blocks
-  for (int i = 0; i < MIN(block_num, NDIRECT); ++i) {
-    bm->free_block(ino->blocks[i]);
-  }
-  if (block_num > NDIRECT) {
-    char indirect_block[BLOCK_SIZE];
-    bm->read_block(ino->blocks[NDIRECT], indirect_block);
-    for (int i = NDIRECT; i < block_num; ++i) {
-      bm->free_block(indirect_blockid(i, indirect_block));
-    }
-    bm->free_block(ino->blocks[NDIRECT]);
-  }
+  if (ino == nullptr)
+    return;
 
-  //free inode
+  //free blocks, then the overflow chain, then the inode
+  std::vector<extent> ext;
+  get_extents(ino, ext);
+  cut_blocks(ext, 0);
+  put_extents(ino, ext, NULL);
   free_inode(inum);
 
   delete ino;
-  
-  return;
 }
 
 void inode_manager::save_current_disk(std::string pathname)
@@ -448,10 +931,13 @@ void disk::save_current_disk(std::string pathname)
 void inode_manager::restore_current_disk(std::string pathname)
 {
   bm->restore_current_disk(pathname);
+  load_free_inodes();
 }
 void block_manager::restore_current_disk(std::string pathname)
 {
+  std::lock_guard<std::mutex> l(bitmap_mtx);
   d->restore_current_disk(pathname);
+  load_free_map();
 }
 void disk::restore_current_disk(std::string pathname)
 {
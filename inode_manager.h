@@ -4,6 +4,8 @@
 #define inode_h
 
 #include <stdint.h>
+#include <mutex>
+#include <vector>
 #include "extent_protocol.h"
 
 #define DISK_SIZE  1024*1024*16
@@ -22,6 +24,12 @@ class disk {
   disk();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  // n blocks starting at id
+  void read_blocks(uint32_t id, int n, char *buf);
+  void write_blocks(uint32_t id, int n, const char *buf);
+  const char *view_block(uint32_t id) const {
+    return (const char *) blocks[id];
+  }
 
   void save_current_disk(std::string pathname);
   void restore_current_disk(std::string pathname);
@@ -39,19 +47,62 @@ class block_manager {
  private:
   disk *d;
   std::map <uint32_t, int> using_blocks;
+  // The block bitmap kept in memory as 64-bit words, a set bit for a
+  // block in use; blocks before the data are always set. Every change
+  // is written through to the bitmap on disk, which stays the record.
+  // nfree counts the free blocks under each bitmap block, so a full
+  // stretch of the disk is passed over without looking at its words.
+  // free_total is their sum, and reserved how many of those free
+  // blocks reserve has set aside. All are guarded by bitmap_mtx.
+  std::vector<uint64_t> used;
+  std::vector<uint32_t> nfree;
+  uint32_t free_total;
+  uint32_t reserved;
+  blockid_t cursor;   // next fit: where the last allocation ended
+  void load_free_map();
+  void mark_blocks(blockid_t start, int n, bool inuse);
+  int free_run(blockid_t id, int max);
+  int find_run(blockid_t from, blockid_t to, int n, blockid_t &start,
+               blockid_t &best, int &best_len, long &budget);
  public:
   block_manager();
   struct superblock sb;
+  // guards the bitmap blocks and the map of them in memory
+  std::mutex bitmap_mtx;
 
   //blockid：block的index
-  bool isfree_block(blockid_t blockid, char *buf);
+  bool isfree_block(blockid_t blockid, const char *buf);
   void setbit_block(blockid_t blockid, char *buf);
   void freebit_block(blockid_t blockid, char *buf);
 
-  uint32_t alloc_block();
+  // A free block into id; false, with id left alone, if the disk is
+  // full.
+  bool alloc_block(blockid_t &id);
+  // Up to n free blocks in a row, the first at start: a run of all n if
+  // the disk has one, else the longest it has. Returns how many, or -1,
+  // with start left alone, if the disk is full. Blocks set aside by
+  // reserve count as taken unless the caller passes its reservation,
+  // which the allocation then draws down.
+  int alloc_blocks(int n, blockid_t &start, uint32_t *reservation = NULL);
   void free_block(uint32_t id);
+  // Blocks freed with a reservation go back into it.
+  void free_blocks(blockid_t start, int n, uint32_t *reservation = NULL);
+  // Set aside n free blocks that only allocations passing the
+  // reservation may take; false if fewer than n are free and not set
+  // aside already. unreserve gives back what a reservation has left.
+  bool reserve(uint32_t n);
+  void unreserve(uint32_t n);
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  // Block id in place, without a copy. The view aliases the disk, so it
+  // sees later writes to the block: the caller must hold whatever keeps
+  // the block from changing (the inode lock, or bitmap_mtx) while it
+  // looks.
+  const char *view_block(uint32_t id) { return d->view_block(id); }
+  // Blocks ids[0..n) to or from buf, BLOCK_SIZE bytes each, in order.
+  // A run of consecutive ids moves as one copy.
+  void read_blocks(const blockid_t *ids, int n, char *buf);
+  void write_blocks(const blockid_t *ids, int n, const char *buf);
 
   void save_current_disk(std::string pathname);
   void restore_current_disk(std::string pathname);
@@ -61,50 +112,107 @@ class block_manager {
 
 #define INODE_NUM  1024
 
-// Inodes per block.
-#define IPB           1
-//(BLOCK_SIZE / sizeof(struct inode))
-
-// Block containing inode i
-#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
-
-//最开始的一个data block
-#define DATA_BLOCK0 IBLOCK(INODE_NUM, BLOCK_NUM) + 1
-
 // Bitmap bits per block
 #define BPB           (BLOCK_SIZE*8)
 
 // Block containing bit for block b
 #define BBLOCK(b) ((b)/BPB + 2)
 
-#define NDIRECT 100
-#define NINDIRECT (BLOCK_SIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A file maps its blocks as extents, runs of len blocks from start, in
+// file order. The first NEXTENT are in the inode; the rest go in a
+// chain of overflow blocks, EPB to a block, so a file can grow as
+// large as the disk has room for.
+struct extent {
+  blockid_t start;
+  uint32_t len;
+};
+
+#define NEXTENT 12
 
 typedef struct inode {
-  short type;
+  short type;                    // 0 while the inode is free
   unsigned int size;
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
-  blockid_t blocks[NDIRECT+1];   // Data block addresses
+  uint32_t nextent;              // extents in all, here and overflowed
+  struct extent ext[NEXTENT];
+  blockid_t overflow;            // first overflow block, or 0
 } inode_t;
 
+#define EPB ((BLOCK_SIZE - sizeof(blockid_t)) / sizeof(struct extent))
+
+typedef struct overflow_block {
+  blockid_t next;                // the next in the chain, or 0
+  struct extent ext[EPB];
+} overflow_block_t;
+
+// Inodes per block.
+#define IPB           (BLOCK_SIZE / sizeof(struct inode))
+
+// Block containing inode i
+#define IBLOCK(i, nblocks)     ((nblocks)/BPB + (i)/IPB + 3)
+
+//最开始的一个data block
+#define DATA_BLOCK0 IBLOCK(INODE_NUM, BLOCK_NUM) + 1
+
+// Largest file, in blocks: the disk is the limit
+#define MAXFILE BLOCK_NUM
+
 class inode_manager {
  private:
   block_manager *bm;
+  // Free inodes as a two-level bitmap: bit (i-1)%64 of ifree[(i-1)/64]
+  // is set while inode i is free, and bit w of ifree_words while
+  // ifree[w] has any bit set, so finding a free inode is two
+  // count-trailing-zeros. It mirrors the type fields of the inode
+  // table, which stay the record.
+  uint64_t ifree[INODE_NUM / 64];
+  uint64_t ifree_words;
+  // Guards ifree and the inode table. Several inodes share a block, so
+  // writing one back is a read-modify-write of the others; readers
+  // holding only a shared inode lock also write back atime.
+  std::mutex itable_mtx;
+  void load_free_inodes();
+  void set_inode_free(uint32_t inum, bool free);
+  bool inode_free(uint32_t inum) const {
+    return (ifree[(inum - 1) / 64] >> ((inum - 1) % 64)) & 1;
+  }
   struct inode* get_inode(uint32_t inum);
   void put_inode(uint32_t inum, struct inode *ino);
-
-  blockid_t indirect_blockid(int index, char *buf);
-  void set_indirect_blockid(int index, blockid_t newid, char *buf);
+  void write_inode(uint32_t inum, const struct inode *ino);
+
+  void get_extents(const struct inode *ino, std::vector<extent> &ext);
+  bool put_extents(struct inode *ino, const std::vector<extent> &ext,
+                   uint32_t *reservation);
+  static void map_blocks(const std::vector<extent> &ext, int first, int n,
+                         blockid_t *ids);
+  static void add_blocks(std::vector<extent> &ext, const blockid_t *ids,
+                         int n);
+  void cut_blocks(std::vector<extent> &ext, int nblocks);
+  bool alloc_blocks(blockid_t *ids, int n, uint32_t *reservation);
+  void free_ids(const blockid_t *ids, int n, uint32_t *reservation);
 
  public:
   inode_manager();
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
-  void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  // how many alloc_inode calls would succeed now
+  uint32_t free_inodes();
+  // Set aside n blocks for the writes of one transaction, which pass
+  // the reservation to write_file and write_range; see block_manager.
+  bool reserve_blocks(uint32_t n);
+  void unreserve_blocks(uint32_t n);
+  void read_file(uint32_t inum, std::string &buf);
+  // The writes return false, leaving the file as it was, only if the
+  // disk has no room for it.
+  bool write_file(uint32_t inum, const char *buf, int size,
+                  uint32_t *reservation = NULL);
+  void read_range(uint32_t inum, unsigned int off, unsigned int len,
+                  std::string &buf);
+  bool write_range(uint32_t inum, unsigned int off, const char *buf,
+                   unsigned int size, uint32_t *reservation = NULL);
+  void truncate(uint32_t inum, unsigned int size);
   void remove_file(uint32_t inum);
   void get_attr(uint32_t inum, extent_protocol::attr &a);
 
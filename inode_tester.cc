@@ -0,0 +1,408 @@
+//
+// Inode layer tester: runs inode_manager and block_manager in this
+// process on a fresh in-memory disk and checks what they leave on it.
+//
+
+#include "inode_manager.h"
+#include "lang/verify.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+typedef extent_protocol P;
+
+void
+fail(const char *what)
+{
+  fprintf(stderr, "error: %s\n", what);
+  fprintf(stdout, "error: %s\n", what);
+  exit(1);
+}
+
+// len bytes that differ from those of any other seed or offset
+std::string
+pattern(uint32_t seed, size_t off, size_t len)
+{
+  std::string s(len, 0);
+  for (size_t i = 0; i < len; i++)
+    s[i] = (char) ((off + i) * 7 + seed * 13 + (off + i) / 251);
+  return s;
+}
+
+// The whole disk, as save_current_disk writes it.
+std::string
+disk_image(inode_manager *im)
+{
+  char path[] = "/tmp/inode_tester.XXXXXX";
+  int fd = mkstemp(path);
+  VERIFY(fd >= 0);
+  close(fd);
+  im->save_current_disk(path);
+  std::ifstream in(path, std::ios::binary);
+  std::ostringstream ost;
+  ost << in.rdbuf();
+  unlink(path);
+  return ost.str();
+}
+
+// how many blocks differ between two disk images
+int
+changed_blocks(const std::string &a, const std::string &b)
+{
+  int n = 0;
+  for (size_t i = 0; i < a.size(); i += BLOCK_SIZE)
+    if (a.compare(i, BLOCK_SIZE, b, i, BLOCK_SIZE) != 0)
+      n++;
+  return n;
+}
+
+// test1: read_range and write_range see and touch only the bytes asked
+// for; a write past the end leaves a hole that reads as zeros.
+void
+test1(void)
+{
+  printf("test1: byte ranges of a file\n");
+  inode_manager *im = new inode_manager();
+  uint32_t ino = im->alloc_inode(P::T_FILE);
+  std::string data = pattern(1, 0, 100 * 1024);
+  if (!im->write_range(ino, 0, data.data(), data.size()))
+    fail("writing a 100 KB file");
+
+  // 4 KB off block boundaries: nine data blocks and the inode
+  std::string before = disk_image(im);
+  std::string patch = pattern(2, 0, 4096);
+  if (!im->write_range(ino, 50000, patch.data(), patch.size()))
+    fail("writing 4 KB into the file");
+  data.replace(50000, patch.size(), patch);
+  int n = changed_blocks(before, disk_image(im));
+  printf("test1: a 4 KB write changed %d blocks\n", n);
+  if (n > 10)
+    fail("a 4 KB write changed blocks it does not cover");
+
+  std::string s;
+  im->read_file(ino, s);
+  if (s != data)
+    fail("the file differs after a range write");
+  im->read_range(ino, 49990, 4200, s);
+  if (s != data.substr(49990, 4200))
+    fail("read_range across the write");
+  im->read_range(ino, data.size() - 10, 100, s);
+  if (s != data.substr(data.size() - 10))
+    fail("read_range past the end is not cut short");
+  im->read_range(ino, data.size() + 5, 10, s);
+  if (!s.empty())
+    fail("read_range wholly past the end returned bytes");
+
+  if (!im->write_range(ino, data.size() + 1000, "tail", 4))
+    fail("writing past the end");
+  data.resize(data.size() + 1000, '\0');
+  data += "tail";
+  im->read_file(ino, s);
+  P::attr a;
+  im->get_attr(ino, a);
+  if (s != data || a.size != data.size())
+    fail("a write past the end left no hole of zeros");
+
+  im->remove_file(ino);
+  printf("test1: passed\n");
+}
+
+// test2: vectored block reads and writes move whole blocks in order,
+// whether or not the ids run on, and a view shows the block in place.
+void
+test2(void)
+{
+  printf("test2: vectored block I/O and block views\n");
+  block_manager *bm = new block_manager();
+  const int n = 8;
+  // two runs, a lone block, and a run listed backwards
+  blockid_t base = DATA_BLOCK0 + 100;
+  blockid_t ids[n] = { base, base + 1, base + 2, base + 10,
+                       base + 20, base + 21, base + 31, base + 30 };
+  std::string data = pattern(3, 0, n * BLOCK_SIZE);
+  bm->write_blocks(ids, n, data.data());
+
+  char buf[BLOCK_SIZE];
+  for (int i = 0; i < n; i++) {
+    bm->read_block(ids[i], buf);
+    if (memcmp(buf, data.data() + i * BLOCK_SIZE, BLOCK_SIZE) != 0)
+      fail("write_blocks put a block in the wrong place");
+    if (memcmp(bm->view_block(ids[i]), buf, BLOCK_SIZE) != 0)
+      fail("a view differs from read_block");
+  }
+  bm->read_block(base + 3, buf);
+  if (buf[0] != 0 || memcmp(buf, buf + 1, BLOCK_SIZE - 1) != 0)
+    fail("write_blocks wrote past a run");
+
+  std::string back(n * BLOCK_SIZE, 'x');
+  bm->read_blocks(ids, n, &back[0]);
+  if (back != data)
+    fail("read_blocks returned other bytes");
+
+  // a view aliases the disk, so it sees a later write
+  const char *v = bm->view_block(base + 10);
+  std::string later = pattern(4, 0, BLOCK_SIZE);
+  bm->write_block(base + 10, later.data());
+  if (memcmp(v, later.data(), BLOCK_SIZE) != 0)
+    fail("a view missed a later write");
+  printf("test2: passed\n");
+}
+
+// test3: the allocator hands out every data block once, in runs when
+// asked, says so when the disk is full, and keeps the bitmap on disk in
+// step, so a restored disk allocates the same free blocks.
+void
+test3(void)
+{
+  printf("test3: block allocation\n");
+  block_manager *bm = new block_manager();
+  const uint32_t ndata = BLOCK_NUM - (DATA_BLOCK0);
+  std::vector<bool> held(BLOCK_NUM, false);
+  uint32_t nheld = 0;
+
+  blockid_t start;
+  if (bm->alloc_blocks(64, start) != 64)
+    fail("a fresh disk has no run of 64 blocks");
+  for (int k = 0; k < 64; k++)
+    held[start + k] = true;
+  nheld += 64;
+
+  blockid_t b;
+  while (bm->alloc_block(b)) {
+    if (b < DATA_BLOCK0 || b >= BLOCK_NUM || held[b])
+      fail("alloc_block handed out a block twice or outside the data");
+    held[b] = true;
+    nheld++;
+  }
+  if (nheld != ndata)
+    fail("alloc_block reported a full disk early");
+  blockid_t untouched = 12345;
+  b = untouched;
+  start = untouched;
+  if (bm->alloc_block(b) || b != untouched ||
+      bm->alloc_blocks(4, start) != -1 || start != untouched)
+    fail("a full disk was not reported, or the id was touched");
+
+  // free and take back at random; runs may come back shorter than asked
+  srandom(3);
+  for (int round = 0; round < 2000; round++) {
+    if (random() % 2) {
+      int k = random() % 40;
+      for (int j = 0; j < k && nheld > 0; j++) {
+        blockid_t id = DATA_BLOCK0 + random() % ndata;
+        while (!held[id])
+          id = id + 1 < BLOCK_NUM ? id + 1 : DATA_BLOCK0;
+        bm->free_block(id);
+        held[id] = false;
+        nheld--;
+      }
+    } else {
+      int got = bm->alloc_blocks(random() % 50 + 1, start);
+      for (int k = 0; k < got; k++) {
+        if (held[start + k])
+          fail("alloc_blocks handed out a block twice");
+        held[start + k] = true;
+      }
+      nheld += got > 0 ? got : 0;
+    }
+  }
+
+  char buf[BLOCK_SIZE];
+  for (blockid_t id = DATA_BLOCK0; id < BLOCK_NUM; id++) {
+    bm->read_block(BBLOCK(id), buf);
+    if (bm->isfree_block(id, buf) == held[id])
+      fail("the bitmap on disk disagrees with the allocator");
+  }
+
+  char path[] = "/tmp/inode_tester.XXXXXX";
+  int fd = mkstemp(path);
+  VERIFY(fd >= 0);
+  close(fd);
+  bm->save_current_disk(path);
+  block_manager *again = new block_manager();
+  again->restore_current_disk(path);
+  unlink(path);
+  uint32_t nfree = 0;
+  while (again->alloc_block(b)) {
+    if (held[b])
+      fail("a restored disk handed out a block in use");
+    nfree++;
+  }
+  if (nfree + nheld != ndata)
+    fail("a restored disk lost free blocks");
+  printf("test3: passed\n");
+}
+
+// test4: alloc_inode hands out every inode once and the lowest free
+// one first, free_inode gives it back, and the free-inode index is
+// rebuilt from the inode table when a disk is restored.
+void
+test4(void)
+{
+  printf("test4: inode allocation\n");
+  inode_manager *im = new inode_manager();
+  std::vector<bool> held(INODE_NUM + 1, false);
+  held[1] = true;   // the root
+  uint32_t nheld = 1, i;
+  while ((i = im->alloc_inode(P::T_FILE)) != 0) {
+    if (i < 1 || i > INODE_NUM || held[i])
+      fail("alloc_inode handed out an inode twice or out of range");
+    held[i] = true;
+    nheld++;
+  }
+  if (nheld != INODE_NUM || im->free_inodes() != 0)
+    fail("alloc_inode reported no free inode early");
+
+  for (i = 700; i > 600; i -= 3) {
+    im->free_inode(i);
+    held[i] = false;
+    nheld--;
+  }
+  im->free_inode(652);   // freeing twice is harmless
+  P::attr a;
+  im->get_attr(601, a);
+  if (a.type != 0 || im->free_inodes() != INODE_NUM - nheld)
+    fail("free_inode left the inode in use");
+
+  char path[] = "/tmp/inode_tester.XXXXXX";
+  int fd = mkstemp(path);
+  VERIFY(fd >= 0);
+  close(fd);
+  im->save_current_disk(path);
+  inode_manager *again = new inode_manager();
+  again->restore_current_disk(path);
+  unlink(path);
+  if (again->free_inodes() != INODE_NUM - nheld)
+    fail("a restored disk counts other free inodes");
+  if (again->alloc_inode(P::T_DIR) != 601)
+    fail("a restored disk did not hand out the lowest free inode");
+  again->get_attr(601, a);
+  if (a.type != P::T_DIR)
+    fail("alloc_inode did not set the type");
+  uint32_t n = 1;
+  while ((i = again->alloc_inode(P::T_FILE)) != 0) {
+    if (held[i])
+      fail("a restored disk handed out an inode in use");
+    n++;
+  }
+  if (n + nheld != INODE_NUM)
+    fail("a restored disk lost free inodes");
+  printf("test4: passed\n");
+}
+
+// test5: two files grown a block at a time in turn take alternate
+// blocks, so each block is an extent of its own and both files run far
+// into their overflow chains. They read back whole, survive overwrite,
+// truncate and a hole, and give back every block when removed. On a
+// full disk a write that does not fit fails and leaves the file as it
+// was.
+void
+test5(void)
+{
+  printf("test5: extents, overflow chains and a full disk\n");
+  inode_manager *im = new inode_manager();
+  std::string empty = disk_image(im);
+  uint32_t a = im->alloc_inode(P::T_FILE), b = im->alloc_inode(P::T_FILE);
+  // far more extents than the inode and one overflow block hold
+  const size_t nblock = NEXTENT + 4 * EPB;
+  for (size_t k = 0; k < nblock; k++) {
+    size_t off = k * BLOCK_SIZE;
+    if (!im->write_range(a, off, pattern(a, off, BLOCK_SIZE).data(), BLOCK_SIZE) ||
+        !im->write_range(b, off, pattern(b, off, BLOCK_SIZE).data(), BLOCK_SIZE))
+      fail("appending a block");
+  }
+  std::string s, da = pattern(a, 0, nblock * BLOCK_SIZE);
+  im->read_file(a, s);
+  if (s != da)
+    fail("a file with an overflow chain read back wrong");
+  im->read_range(b, 12345, 54321, s);
+  if (s != pattern(b, 12345, 54321))
+    fail("read_range across many extents");
+
+  // overwrite across extents, cut back, and grow again past a hole
+  std::string patch = pattern(9, 0, 20000);
+  if (!im->write_range(a, 30000, patch.data(), patch.size()))
+    fail("overwriting across extents");
+  da.replace(30000, patch.size(), patch);
+  im->truncate(a, 40001);
+  da.resize(40001);
+  if (!im->write_range(a, 90000, "xyz", 3))
+    fail("writing past a hole");
+  da.resize(90000, '\0');
+  da += "xyz";
+  im->read_file(a, s);
+  if (s != da)
+    fail("the file differs after overwrite, truncate and hole");
+
+  // removing both files gives every block back
+  im->remove_file(a);
+  im->remove_file(b);
+  std::string after = disk_image(im);
+  for (blockid_t id = BBLOCK(0); id <= BBLOCK(BLOCK_NUM - 1); id++)
+    if (after.compare(id * BLOCK_SIZE, BLOCK_SIZE, empty, id * BLOCK_SIZE,
+                      BLOCK_SIZE) != 0)
+      fail("removing the files left blocks in use");
+
+  // fill the disk, then try to grow and to replace a file
+  uint32_t f = im->alloc_inode(P::T_FILE), fill = im->alloc_inode(P::T_FILE);
+  std::string df = pattern(f, 0, 10000);
+  if (!im->write_file(f, df.data(), df.size()))
+    fail("writing the file");
+  std::string chunk(64 * BLOCK_SIZE, 'f');
+  size_t end = 0;
+  while (im->write_range(fill, end, chunk.data(), chunk.size()))
+    end += chunk.size();
+  while (im->write_range(fill, end, chunk.data(), BLOCK_SIZE))
+    end += BLOCK_SIZE;
+  std::string big = pattern(7, 0, 64 * BLOCK_SIZE);
+  if (im->write_range(f, df.size(), big.data(), big.size()) ||
+      im->write_file(f, big.data(), big.size()))
+    fail("a write larger than the free space succeeded");
+  P::attr at;
+  im->get_attr(f, at);
+  im->read_file(f, s);
+  if (s != df || at.size != df.size())
+    fail("a failed write changed the file");
+  // an overwrite needs no new blocks, so it still fits
+  if (!im->write_range(f, 100, "in place", 8))
+    fail("an in-place write failed on a full disk");
+  printf("test5: passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int test = 0;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [test]\n", argv[0]);
+    exit(1);
+  }
+  if (argc > 1) {
+    test = atoi(argv[1]);
+    if (test < 1 || test > 5) {
+      printf("Test number must be between 1 and 5\n");
+      exit(1);
+    }
+  }
+
+  if (!test || test == 1)
+    test1();
+  if (!test || test == 2)
+    test2();
+  if (!test || test == 3)
+    test3();
+  if (!test || test == 4)
+    test4();
+  if (!test || test == 5)
+    test5();
+
+  printf("%s: passed all tests successfully\n", argv[0]);
+}
@@ -0,0 +1,192 @@
+// byte-range bookkeeping for range locks
+
+#ifndef interval_tree_h
+#define interval_tree_h
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "lock_protocol.h"
+
+// The ranges [off, end) held on one lock, each SHARED or EXCLUSIVE and
+// tagged with its holder. A treap ordered by start, where every node
+// also knows the largest end below it (of all ranges, and of the
+// EXCLUSIVE ones), so a conflict check skips any subtree that ends
+// before the range in question. Nodes live in one vector and link by
+// index, so the tree moves and copies like a plain value.
+class interval_tree {
+ public:
+  struct interval {
+    unsigned long long off;
+    unsigned long long end;
+    int mode;
+    std::string id;
+  };
+
+ private:
+  struct node {
+    interval iv;
+    unsigned long long seq;       // breaks ties between equal starts
+    uint32_t prio;
+    int left, right;
+    unsigned long long maxend;    // largest end in this subtree
+    unsigned long long maxend_ex; // ... among EXCLUSIVE ranges
+  };
+  std::vector<node> nodes;
+  std::vector<int> free_nodes;
+  int root;
+  size_t count;
+  unsigned long long next_seq;
+  uint32_t rng;
+
+  static bool before(const node &a, unsigned long long off,
+                     unsigned long long seq) {
+    return a.iv.off < off || (a.iv.off == off && a.seq < seq);
+  }
+  void pull(int n) {
+    node &x = nodes[n];
+    x.maxend = x.iv.end;
+    x.maxend_ex = x.iv.mode == lock_protocol::EXCLUSIVE ? x.iv.end : 0;
+    for (int c : {x.left, x.right}) {
+      if (c < 0)
+        continue;
+      if (nodes[c].maxend > x.maxend)
+        x.maxend = nodes[c].maxend;
+      if (nodes[c].maxend_ex > x.maxend_ex)
+        x.maxend_ex = nodes[c].maxend_ex;
+    }
+  }
+  // split n into nodes before (off, seq) and the rest
+  void split(int n, unsigned long long off, unsigned long long seq,
+             int &l, int &r) {
+    if (n < 0) {
+      l = r = -1;
+    } else if (before(nodes[n], off, seq)) {
+      split(nodes[n].right, off, seq, nodes[n].right, r);
+      l = n;
+      pull(n);
+    } else {
+      split(nodes[n].left, off, seq, l, nodes[n].left);
+      r = n;
+      pull(n);
+    }
+  }
+  int merge(int l, int r) {
+    if (l < 0)
+      return r;
+    if (r < 0)
+      return l;
+    if (nodes[l].prio > nodes[r].prio) {
+      nodes[l].right = merge(nodes[l].right, r);
+      pull(l);
+      return l;
+    }
+    nodes[r].left = merge(l, nodes[r].left);
+    pull(r);
+    return r;
+  }
+  int find(int n, const interval &iv) const {
+    if (n < 0)
+      return -1;
+    const node &x = nodes[n];
+    if (iv.off < x.iv.off)
+      return find(x.left, iv);
+    if (iv.off > x.iv.off)
+      return find(x.right, iv);
+    if (x.iv.end == iv.end && x.iv.mode == iv.mode && x.iv.id == iv.id)
+      return n;
+    int f = find(x.left, iv);
+    return f >= 0 ? f : find(x.right, iv);
+  }
+  int remove(int n, unsigned long long off, unsigned long long seq) {
+    const node &x = nodes[n];
+    if (x.iv.off == off && x.seq == seq)
+      return merge(x.left, x.right);
+    if (before(x, off, seq))
+      nodes[n].right = remove(x.right, off, seq);
+    else
+      nodes[n].left = remove(x.left, off, seq);
+    pull(n);
+    return n;
+  }
+  bool overlaps(int n, unsigned long long off, unsigned long long end,
+                bool ex_only) const {
+    if (n < 0)
+      return false;
+    const node &x = nodes[n];
+    if ((ex_only ? x.maxend_ex : x.maxend) <= off)
+      return false;
+    if (x.iv.off >= end)
+      return overlaps(x.left, off, end, ex_only);
+    if (x.iv.end > off &&
+        (!ex_only || x.iv.mode == lock_protocol::EXCLUSIVE))
+      return true;
+    return overlaps(x.left, off, end, ex_only) ||
+      overlaps(x.right, off, end, ex_only);
+  }
+  template<class F> void walk(int n, F &f) const {
+    if (n < 0)
+      return;
+    walk(nodes[n].left, f);
+    f(nodes[n].iv);
+    walk(nodes[n].right, f);
+  }
+
+ public:
+  interval_tree() : root(-1), count(0), next_seq(0), rng(0x9e3779b9) {}
+
+  // Would a range [off, end) held in mode clash with one held now?
+  // Readers only clash with writers; a writer clashes with anything.
+  bool conflicts(unsigned long long off, unsigned long long end,
+                 int mode) const {
+    return overlaps(root, off, end, mode != lock_protocol::EXCLUSIVE);
+  }
+
+  void insert(const interval &iv) {
+    int n;
+    if (!free_nodes.empty()) {
+      n = free_nodes.back();
+      free_nodes.pop_back();
+    } else {
+      n = nodes.size();
+      nodes.push_back(node());
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    node &x = nodes[n];
+    x.iv = iv;
+    x.seq = next_seq++;
+    x.prio = rng;
+    x.left = x.right = -1;
+    pull(n);
+
+    int l, r;
+    split(root, iv.off, x.seq, l, r);
+    root = merge(merge(l, n), r);
+    count++;
+  }
+
+  // Remove one range equal to iv; false if there is none.
+  bool erase(const interval &iv) {
+    int n = find(root, iv);
+    if (n < 0)
+      return false;
+    root = remove(root, nodes[n].iv.off, nodes[n].seq);
+    nodes[n].iv.id.clear();
+    free_nodes.push_back(n);
+    if (--count == 0) {
+      nodes.clear();
+      free_nodes.clear();
+    }
+    return true;
+  }
+
+  // Call f(interval) for every range in order of start.
+  template<class F> void for_each(F f) const { walk(root, f); }
+
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+};
+
+#endif
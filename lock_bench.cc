@@ -0,0 +1,178 @@
+//
+// Lock server load generator: several caching clients in one process,
+// each with several threads, acquiring locks drawn from a Zipf
+// distribution and holding them for a while. Reports throughput and
+// acquire latency percentiles.
+//
+
+#include "lock_protocol.h"
+#include "lock_client_cache.h"
+#include "rpc.h"
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "lang/verify.h"
+
+int nclients = 2;
+int nthreads = 4;            // per client
+int nlocks = 1000;
+double zipf = 0.0;           // 0 is uniform
+int hold_us = 0;
+int read_pct = 0;            // share of acquires taken SHARED
+double duration = 5.0;       // seconds
+
+std::vector<lock_client_cache *> lc;
+std::vector<double> cdf;     // cdf[i] = P(lock <= i)
+volatile bool stop;
+
+struct worker {
+  int client;
+  unsigned int seed;
+  std::vector<unsigned int> rd_ns;   // acquire latencies, SHARED
+  std::vector<unsigned int> wr_ns;   // ... EXCLUSIVE
+};
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+make_cdf()
+{
+  cdf.resize(nlocks);
+  double sum = 0;
+  for (int i = 0; i < nlocks; i++) {
+    sum += 1.0 / pow(i + 1, zipf);
+    cdf[i] = sum;
+  }
+  for (int i = 0; i < nlocks; i++)
+    cdf[i] /= sum;
+}
+
+static lock_protocol::lockid_t
+pick(unsigned int *seed)
+{
+  double u = rand_r(seed) / (RAND_MAX + 1.0);
+  size_t i = std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+  if (i >= cdf.size())
+    i = cdf.size() - 1;
+  // rank 0 is the hottest lock; keep clear of the ids chfs uses for
+  // small inode numbers if both run against the same server
+  return (1ULL << 32) + i;
+}
+
+void *
+run(void *x)
+{
+  worker *w = (worker *) x;
+  lock_client_cache *c = lc[w->client];
+
+  while (!stop) {
+    lock_protocol::lockid_t lid = pick(&w->seed);
+    bool rd = (int) (rand_r(&w->seed) % 100) < read_pct;
+    double t0 = now();
+    if (rd)
+      VERIFY(c->acquire_shared(lid) == lock_protocol::OK);
+    else
+      VERIFY(c->acquire(lid) == lock_protocol::OK);
+    unsigned int ns = (unsigned int) std::min((now() - t0) * 1e9, 4e9);
+    (rd ? w->rd_ns : w->wr_ns).push_back(ns);
+    if (hold_us > 0)
+      usleep(hold_us);
+    c->release(lid);
+  }
+  return 0;
+}
+
+static void
+report(const char *what, std::vector<unsigned int> &ns, double secs)
+{
+  if (ns.empty())
+    return;
+  std::sort(ns.begin(), ns.end());
+  size_t n = ns.size();
+  printf("%-6s %12.0f %10.1f %10.1f %10.1f %10.1f\n", what, n / secs,
+         ns[n / 2] / 1e3, ns[std::min(n - 1, n * 99 / 100)] / 1e3,
+         ns[std::min(n - 1, n * 999 / 1000)] / 1e3, ns[n - 1] / 1e3);
+}
+
+static void
+usage(char *prog)
+{
+  fprintf(stderr, "Usage: %s [-c clients] [-t threads-per-client] "
+          "[-n locks] [-z zipf] [-h hold-us] [-r read-pct] [-d secs] "
+          "[host:]port|config\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ch;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  while ((ch = getopt(argc, argv, "c:t:n:z:h:r:d:")) != -1) {
+    switch (ch) {
+    case 'c': nclients = atoi(optarg); break;
+    case 't': nthreads = atoi(optarg); break;
+    case 'n': nlocks = atoi(optarg); break;
+    case 'z': zipf = atof(optarg); break;
+    case 'h': hold_us = atoi(optarg); break;
+    case 'r': read_pct = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || nclients < 1 || nthreads < 1 || nlocks < 1 ||
+      zipf < 0 || hold_us < 0 || read_pct < 0 || read_pct > 100 ||
+      duration <= 0)
+    usage(argv[0]);
+
+  make_cdf();
+  for (int i = 0; i < nclients; i++)
+    lc.push_back(new lock_client_cache(argv[optind]));
+
+  int nt = nclients * nthreads;
+  std::vector<pthread_t> th(nt);
+  std::vector<worker> w(nt);
+  stop = false;
+  double start = now();
+  for (int i = 0; i < nt; i++) {
+    w[i].client = i % nclients;
+    w[i].seed = getpid() * 7919 + i;
+    VERIFY(pthread_create(&th[i], NULL, run, (void *) &w[i]) == 0);
+  }
+  while (now() - start < duration)
+    usleep(10000);
+  stop = true;
+  for (int i = 0; i < nt; i++)
+    pthread_join(th[i], NULL);
+  double secs = now() - start;
+
+  std::vector<unsigned int> rd, wr, all;
+  for (int i = 0; i < nt; i++) {
+    rd.insert(rd.end(), w[i].rd_ns.begin(), w[i].rd_ns.end());
+    wr.insert(wr.end(), w[i].wr_ns.begin(), w[i].wr_ns.end());
+  }
+  all = rd;
+  all.insert(all.end(), wr.begin(), wr.end());
+
+  printf("%d clients x %d threads, %d locks, zipf %.2f, hold %dus, "
+         "%d%% shared, %.1fs\n", nclients, nthreads, nlocks, zipf, hold_us,
+         read_pct, secs);
+  printf("%-6s %12s %10s %10s %10s %10s\n", "", "acquires/s", "p50 us",
+         "p99 us", "p999 us", "max us");
+  report("shared", rd, secs);
+  report("excl", wr, secs);
+  report("all", all, secs);
+  return 0;
+}
@@ -7,31 +7,113 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <algorithm>
+#include "server_list.h"
+
+static uint64_t
+fnv1a(const std::string &s)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < s.size(); i++) {
+    h ^= (unsigned char) s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t
+mix(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+hash_ring::hash_ring(const std::vector<std::string> &servers)
+  : nservers(servers.size())
+{
+  // the points depend only on the servers' names, so every client
+  // builds the same ring from the same list in any order
+  for (size_t i = 0; i < servers.size(); i++) {
+    for (int v = 0; v < VNODES; v++) {
+      std::ostringstream ost;
+      ost << servers[i] << "#" << v;
+      points.push_back(std::make_pair(mix(fnv1a(ost.str())), (int) i));
+    }
+  }
+  std::sort(points.begin(), points.end());
+}
+
+int
+hash_ring::route(lock_protocol::lockid_t lid) const
+{
+  if (nservers == 1)
+    return 0;
+  std::vector<std::pair<uint64_t, int> >::const_iterator it =
+    std::lower_bound(points.begin(), points.end(), std::make_pair(mix(lid), 0));
+  if (it == points.end())
+    it = points.begin();
+  return it->second;
+}
 
 lock_client::lock_client(std::string dst)
+  : servers(parse_server_list(dst)), ring(servers)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() < 0) {
-    printf("lock_client: call bind\n");
+  for (size_t i = 0; i < servers.size(); i++) {
+    sockaddr_in dstsock;
+    make_sockaddr(servers[i].c_str(), &dstsock);
+    rpcc *c = new rpcc(dstsock);
+    if (c->bind() < 0) {
+      printf("lock_client: call bind %s\n", servers[i].c_str());
+    }
+    cls.push_back(c);
   }
+  cl = cls[0];
 }
 
 int
 lock_client::stat(lock_protocol::lockid_t lid)
 {
   int r;
-  lock_protocol::status ret = cl->call(lock_protocol::stat, cl->id(), lid, r);
+  rpcc *c = server(lid);
+  lock_protocol::status ret = c->call(lock_protocol::stat, c->id(), lid, r);
   VERIFY (ret == lock_protocol::OK);
   return r;
 }
 
+// Ask every server for its n hottest locks and keep the n hottest of
+// those, ranked the way each server ranks its own.
+static bool
+hotter(const lock_protocol::lock_stat &a, const lock_protocol::lock_stat &b)
+{
+  if (a.contended != b.contended)
+    return a.contended > b.contended;
+  return a.acquires > b.acquires;
+}
+
+lock_protocol::status
+lock_client::stat_top(int n, std::vector<lock_protocol::lock_stat> &r)
+{
+  r.clear();
+  for (size_t i = 0; i < cls.size(); i++) {
+    std::vector<lock_protocol::lock_stat> top;
+    lock_protocol::status ret = cls[i]->call(lock_protocol::stat_top, n, top);
+    if (ret != lock_protocol::OK)
+      return ret;
+    r.insert(r.end(), top.begin(), top.end());
+  }
+  std::stable_sort(r.begin(), r.end(), hotter);
+  if ((int) r.size() > n)
+    r.resize(n);
+  return lock_protocol::OK;
+}
+
 lock_protocol::status
 lock_client::acquire(lock_protocol::lockid_t lid)
 {
 	int r;
-  lock_protocol::status ret = cl->call(lock_protocol::acquire, cl->id(), lid, r);
+  rpcc *c = server(lid);
+  lock_protocol::status ret = c->call(lock_protocol::acquire, c->id(), lid, r);
   // VERIFY (ret == lock_protocol::OK);
   return ret;
 }
@@ -40,7 +122,8 @@ lock_protocol::status
 lock_client::release(lock_protocol::lockid_t lid)
 {
 	int r;
-  lock_protocol::status ret = cl->call(lock_protocol::release, cl->id(), lid, r);
+  rpcc *c = server(lid);
+  lock_protocol::status ret = c->call(lock_protocol::release, c->id(), lid, r);
   // VERIFY (ret == lock_protocol::OK);
   return ret;
 }
\ No newline at end of file
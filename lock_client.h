@@ -4,20 +4,43 @@
 #define lock_client_h
 
 #include <string>
+#include <stdint.h>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include <vector>
 
-// Client interface to the lock server
+// A consistent-hash ring over servers 0..n-1: every server owns VNODES
+// points on the ring and an id goes to the first point at or after its
+// hash. Adding a server then moves only the ids that land on its
+// points, about 1/n of them.
+class hash_ring {
+  enum { VNODES = 64 };
+  std::vector<std::pair<uint64_t, int> > points; // (point, server), sorted
+  size_t nservers;
+ public:
+  hash_ring(const std::vector<std::string> &servers);
+  int route(lock_protocol::lockid_t) const;
+};
+
+// Client interface to the lock server. dst names one lock server or a
+// file listing several (see server_list.h). With several, each lock id
+// belongs to one server, picked on a hash_ring of them.
 class lock_client {
  protected:
-  rpcc *cl;
+  std::vector<std::string> servers;
+  hash_ring ring;
+  std::vector<rpcc *> cls;                     // one per server
+  rpcc *cl;                                    // cls[0]
+
+  int route(lock_protocol::lockid_t lid) const { return ring.route(lid); }
+  rpcc *server(lock_protocol::lockid_t lid) const { return cls[route(lid)]; }
  public:
   lock_client(std::string d);
   virtual ~lock_client() {};
   virtual lock_protocol::status acquire(lock_protocol::lockid_t);
   virtual lock_protocol::status release(lock_protocol::lockid_t);
   virtual lock_protocol::status stat(lock_protocol::lockid_t);
+  lock_protocol::status stat_top(int n, std::vector<lock_protocol::lock_stat> &);
 };
 
 
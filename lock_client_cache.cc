@@ -0,0 +1,710 @@
+// RPC stubs for clients to talk to lock_server, and cache the locks
+// see lock_client_cache.h for protocol details.
+
+#include "lock_client_cache.h"
+#include "rpc.h"
+#include <sstream>
+#include <iostream>
+#include <stdio.h>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
+#include "tprintf.h"
+
+
+int lock_client_cache::last_port = 0;
+
+lock_client_cache::lock_client_cache(std::string xdst, 
+				     class lock_release_user *_lu,
+				     size_t _max_cached)
+  : lock_client(xdst), lu(_lu), max_cached(_max_cached), use_clock(0),
+    grant_clock(0),
+    trimming(false), lease_term(-1), lease_start(cls.size())
+{
+  srand(time(NULL)^last_port);
+  rlock_port = ((rand()%32000) | (0x1 << 10));
+  const char *hname;
+  // VERIFY(gethostname(hname, 100) == 0);
+  hname = "127.0.0.1";
+  std::ostringstream host;
+  host << hname << ":" << rlock_port;
+  id = host.str();
+  last_port = rlock_port;
+  rpcs *rlsrpc = new rpcs(rlock_port);
+  rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
+  rlsrpc->reg(rlock_protocol::retry, this, &lock_client_cache::retry_handler);
+  rlsrpc->reg(rlock_protocol::range_granted, this,
+              &lock_client_cache::range_granted_handler);
+
+  learn_lease();
+}
+
+// Ask the servers how long their leases last, and start renewing once
+// one has said. A server that does not answer has no lease yet; the
+// renew thread keeps trying it. Until some server answers no lock is
+// taken, so every acquire tries again first. Called with m free.
+bool
+lock_client_cache::learn_lease()
+{
+  if (lease_term >= 0)
+    return true;
+  int known = -1;
+  for (size_t i = 0; i < cls.size(); i++) {
+    clock::time_point sent = clock::now();
+    int term;
+    if (cls[i]->call(lock_protocol::renew, id, term) == lock_protocol::OK) {
+      if (known < 0 || term < known)
+        known = term;
+      renewed(i, sent);
+    } else {
+      tprintf("lock_client_cache(%s): no lease from %s\n", id.c_str(),
+              servers[i].c_str());
+    }
+  }
+  if (known < 0)
+    return false;
+  lease_term = known;
+  if (known > 0) {
+    std::call_once(renewing, [this] {
+      std::thread(&lock_client_cache::renew_loop, this).detach();
+    });
+  }
+  return true;
+}
+
+void
+lock_client_cache::renewed(int srv, clock::time_point sent)
+{
+  long long t = sent.time_since_epoch().count();
+  long long cur = lease_start[srv].load();
+  while (cur < t && !lease_start[srv].compare_exchange_weak(cur, t))
+    ;
+}
+
+bool
+lock_client_cache::lease_valid(int srv, clock::time_point now)
+{
+  if (lease_term == 0)
+    return true;
+  if (lease_term < 0)
+    return false;
+  clock::time_point start{clock::duration(lease_start[srv].load())};
+  return now - start < std::chrono::seconds(lease_term);
+}
+
+// Called with m held. Once a lease has run out that server may have
+// handed our cached locks to someone else, so forget every lock of its
+// that is not waiting on an RPC. A lock local threads still hold is
+// marked lapsed: their releases give nothing back, and nobody else
+// here takes the lock until they are done and the server grants it
+// anew.
+void
+lock_client_cache::check_lease()
+{
+  clock::time_point now = clock::now();
+  std::vector<bool> valid(cls.size());
+  bool all = true;
+  for (size_t i = 0; i < cls.size(); i++) {
+    valid[i] = lease_valid(i, now);
+    all = all && valid[i];
+  }
+  if (all)
+    return;
+
+  std::map<lock_protocol::lockid_t, lock_entry *>::iterator it;
+  for (it = locks.begin(); it != locks.end(); ++it) {
+    lock_entry *e = it->second;
+    if (valid[route(it->first)] || e->held == lock_protocol::NONE ||
+        e->inflight || e->want != lock_protocol::NONE)
+      continue;
+    if (lu)
+      lu->dolapse(it->first);
+    if (e->writer || e->nreaders > 0) {
+      tprintf("lock_client_cache(%s): lease ran out holding %llu\n",
+              id.c_str(), it->first);
+      e->lapsed = true;
+    }
+    e->held = lock_protocol::NONE;
+    e->revoked = false;
+    hand_off(e);
+  }
+}
+
+// Have lu write back what it holds under server srv's locks, while the
+// lease on them still holds. Called with m free.
+void
+lock_client_cache::flush_server(int srv)
+{
+  std::vector<lock_protocol::lockid_t> lids;
+  {
+    std::lock_guard<std::mutex> l(m);
+    std::map<lock_protocol::lockid_t, lock_entry *>::iterator it;
+    for (it = locks.begin(); it != locks.end(); ++it) {
+      if (route(it->first) == srv && it->second->held != lock_protocol::NONE)
+        lids.push_back(it->first);
+    }
+  }
+  for (size_t i = 0; i < lids.size(); i++)
+    lu->dorelease(lids[i]);
+}
+
+void
+lock_client_cache::renew_loop()
+{
+  int period = lease_term > 3 ? lease_term / 3 : 1;
+  while (true) {
+    sleep(period);
+    bool lapsed = false;
+    for (size_t i = 0; i < cls.size(); i++) {
+      clock::time_point start{clock::duration(lease_start[i].load())};
+      if (clock::now() - start >= std::chrono::seconds(period)) {
+        clock::time_point sent = clock::now();
+        int term;
+        if (cls[i]->call(lock_protocol::renew, id, term) == lock_protocol::OK)
+          renewed(i, sent);
+      }
+      // the lease may run out before we look again
+      start = clock::time_point{clock::duration(lease_start[i].load())};
+      if (lu && lease_valid(i, clock::now()) &&
+          clock::now() - start >= std::chrono::seconds(lease_term - period))
+        flush_server(i);
+      if (!lease_valid(i, clock::now()))
+        lapsed = true;
+    }
+    if (lapsed) {
+      std::lock_guard<std::mutex> l(m);
+      check_lease();
+    }
+  }
+}
+
+// Send a request to server srv. Every answered RPC renews our lease
+// there from the moment it went out.
+template<class... A>
+lock_protocol::status
+lock_client_cache::server_call(int srv, unsigned int proc, int &r, const A &...a)
+{
+  clock::time_point sent = clock::now();
+  lock_protocol::status ret = cls[srv]->call(proc, a..., id, r);
+  if (ret == lock_protocol::OK || ret == lock_protocol::RETRY)
+    renewed(srv, sent);
+  return ret;
+}
+
+// Must be called with m locked.
+lock_client_cache::lock_entry *
+lock_client_cache::get_entry(lock_protocol::lockid_t lid)
+{
+  std::map<lock_protocol::lockid_t, lock_entry *>::iterator it = locks.find(lid);
+  if (it != locks.end())
+    return it->second;
+  lock_entry *e = new lock_entry;
+  locks[lid] = e;
+  return e;
+}
+
+// Can a local thread take the lock in mode right now? Unless told to
+// ignore it, a pending revoke keeps new holders out so that the lock
+// drains and goes back to the server.
+bool
+lock_client_cache::can_take(lock_entry *e, int mode, bool ignore_revoke)
+{
+  if (e->held < mode || e->lapsed)
+    return false;
+  if (!ignore_revoke && e->revoked && e->keep < mode)
+    return false;
+  if (mode == lock_protocol::SHARED)
+    return !e->writer;
+  return !e->writer && e->nreaders == 0;
+}
+
+// Called with m held when the server grants the lock in mode.
+void
+lock_client_cache::note_grant(lock_entry *e, int mode)
+{
+  if (e->held == lock_protocol::NONE)
+    e->since = ++grant_clock;
+  if (e->held < mode)
+    e->held = mode;
+}
+
+unsigned long long
+lock_client_cache::mark()
+{
+  std::lock_guard<std::mutex> l(m);
+  return ++grant_clock;
+}
+
+bool
+lock_client_cache::held_since(lock_protocol::lockid_t lid,
+                              unsigned long long mark)
+{
+  std::lock_guard<std::mutex> l(m);
+  std::map<lock_protocol::lockid_t, lock_entry *>::iterator it =
+    locks.find(lid);
+  if (it == locks.end())
+    return false;
+  lock_entry *e = it->second;
+  return e->held != lock_protocol::NONE && !e->lapsed && e->since < mark &&
+    lease_valid(route(lid), clock::now());
+}
+
+void
+lock_client_cache::take(lock_entry *e, int mode)
+{
+  if (mode == lock_protocol::EXCLUSIVE)
+    e->writer = true;
+  else
+    e->nreaders++;
+  e->last_use = ++use_clock;
+}
+
+// Called with m held whenever an entry changes. Give the lock to local
+// waiters from the head of the queue for as long as they fit, a run of
+// readers together, and wake the head if it has to go to the server.
+// Once the server wants the lock back, MAX_HANDOFF more waiters get it
+// and then it drains.
+void
+lock_client_cache::hand_off(lock_entry *e)
+{
+  e->wait_cv.notify_all();
+  while (!e->queue.empty()) {
+    local_waiter *w = e->queue.front();
+    if (!can_take(e, w->mode, e->handoffs < MAX_HANDOFF)) {
+      w->cv.notify_one();
+      return;
+    }
+    e->queue.pop_front();
+    take(e, w->mode);
+    if (e->revoked)
+      e->handoffs++;
+    w->granted = true;
+    w->cv.notify_one();
+  }
+}
+
+// Could the entry be freed, or its lock handed back, without anyone
+// here noticing?
+bool
+lock_client_cache::unused(lock_entry *e)
+{
+  return e->refs == 0 && !e->writer && e->nreaders == 0 && !e->inflight &&
+    !e->fetching &&
+    e->want == lock_protocol::NONE && !e->revoked;
+}
+
+void
+lock_client_cache::ref_all(const std::vector<lock_protocol::lockid_t> &lids,
+                           int d)
+{
+  for (size_t i = 0; i < lids.size(); i++)
+    get_entry(lids[i])->refs += d;
+}
+
+// Called with m held. Hand the least recently used idle locks back to
+// the server and free entries until about 3/4 of max_cached are left;
+// entries of locks we no longer hold go first since they cost no RPC.
+void
+lock_client_cache::trim(std::unique_lock<std::mutex> &l)
+{
+  if (trimming)
+    return;
+  trimming = true;
+
+  std::vector<std::pair<std::pair<bool, unsigned long long>,
+                        lock_protocol::lockid_t> > idle;
+  std::map<lock_protocol::lockid_t, lock_entry *>::iterator it;
+  for (it = locks.begin(); it != locks.end(); ++it) {
+    lock_entry *e = it->second;
+    if (unused(e)) {
+      idle.push_back(std::make_pair(
+        std::make_pair(e->held != lock_protocol::NONE, e->last_use), it->first));
+    }
+  }
+  std::sort(idle.begin(), idle.end());
+
+  size_t target = max_cached * 3 / 4;
+  for (size_t i = 0; i < idle.size() && locks.size() > target; i++) {
+    lock_protocol::lockid_t lid = idle[i].second;
+    it = locks.find(lid);
+    if (it == locks.end() || !unused(it->second))
+      continue;
+    lock_entry *e = it->second;
+    if (e->held != lock_protocol::NONE) {
+      // giving the lock back is a revoke we send ourselves
+      e->revoked = true;
+      e->keep = lock_protocol::NONE;
+      e->refs++;
+      settle(lid, e, l);
+      e->refs--;
+      if (!unused(e) || e->held != lock_protocol::NONE)
+        continue;
+    }
+    locks.erase(lid);
+    delete e;
+  }
+  trimming = false;
+}
+
+// Ask the server for the lock in mode and wait until it is granted.
+// Called and returns with m held.
+lock_protocol::status
+lock_client_cache::request(lock_protocol::lockid_t lid, lock_entry *e,
+                           int mode, std::unique_lock<std::mutex> &l)
+{
+  e->want = mode;
+  e->inflight = true;
+  e->fetching = true;
+  l.unlock();
+  int r;
+  lock_protocol::status ret = server_call(route(lid), mode == lock_protocol::EXCLUSIVE ?
+    lock_protocol::acquire_exclusive : lock_protocol::acquire_shared, r, lid);
+  l.lock();
+  e->inflight = false;
+
+  if (ret == lock_protocol::OK) {
+    note_grant(e, mode);
+    e->want = lock_protocol::NONE;
+  } else if (ret == lock_protocol::RETRY) {
+    // while we wait in the server's queue, a revoke may ask us to drop
+    // a SHARED hold that stands in the way of someone else's upgrade.
+    settle(lid, e, l);
+    while (e->want != lock_protocol::NONE)
+      e->wait_cv.wait(l);
+    ret = lock_protocol::OK;
+  } else {
+    e->want = lock_protocol::NONE;
+  }
+  e->fetching = false;
+  hand_off(e);
+  return ret;
+}
+
+// Act on a pending revoke if no local holder is in the way: downgrade
+// or return the lock. Called with m held; drops it around the RPC.
+void
+lock_client_cache::settle(lock_protocol::lockid_t lid, lock_entry *e,
+                          std::unique_lock<std::mutex> &l)
+{
+  while (e->revoked && !e->inflight) {
+    if (e->held <= e->keep) {
+      e->revoked = false;
+      return;
+    }
+    int proc;
+    if (e->keep == lock_protocol::SHARED) {
+      if (e->writer)
+        return;
+      e->held = lock_protocol::SHARED;
+      proc = lock_protocol::downgrade;
+    } else {
+      if (e->writer || e->nreaders > 0)
+        return;
+      e->held = lock_protocol::NONE;
+      proc = lock_protocol::release;
+    }
+
+    // held is lowered before the RPC goes out, so a grant that races
+    // with it is not undone when it returns.
+    e->revoked = false;
+    e->inflight = true;
+    l.unlock();
+    if (lu)
+      lu->dorelease(lid);
+    int r;
+    lock_protocol::status ret = server_call(route(lid), proc, r, lid);
+    if (ret != lock_protocol::OK)
+      tprintf("lock_client_cache(%s): return %llu failed %d\n", id.c_str(), lid, ret);
+    l.lock();
+    e->inflight = false;
+    hand_off(e);
+  }
+}
+
+lock_protocol::status
+lock_client_cache::acquire_mode(lock_protocol::lockid_t lid, int mode)
+{
+  if (!learn_lease())
+    return lock_protocol::RPCERR;
+  std::unique_lock<std::mutex> l(m);
+  check_lease();
+  lock_entry *e = get_entry(lid);
+  lock_protocol::status ret = lock_protocol::OK;
+  e->refs++;
+
+  if (e->queue.empty() && can_take(e, mode, false)) {
+    take(e, mode);
+    e->refs--;
+    return ret;
+  }
+
+  local_waiter w(mode);
+  e->queue.push_back(&w);
+  hand_off(e);
+  while (!w.granted) {
+    // only the head of the queue talks to the server
+    if (e->queue.front() == &w && e->held < mode &&
+        e->want == lock_protocol::NONE && !e->inflight && !e->fetching) {
+      ret = request(lid, e, mode, l);
+      if (ret != lock_protocol::OK) {
+        e->queue.erase(std::find(e->queue.begin(), e->queue.end(), &w));
+        hand_off(e);
+        break;
+      }
+      // the thread that fetched the lock gets to use it once, even if
+      // a revoke is already waiting for it.
+      if (!w.granted && e->queue.front() == &w && can_take(e, mode, true)) {
+        e->queue.pop_front();
+        take(e, mode);
+        w.granted = true;
+      }
+      continue;
+    }
+    w.cv.wait(l);
+  }
+  // readers queued right behind us may come in too
+  if (w.granted)
+    hand_off(e);
+  e->refs--;
+  return ret;
+}
+
+lock_protocol::status
+lock_client_cache::acquire(lock_protocol::lockid_t lid)
+{
+  return acquire_mode(lid, lock_protocol::EXCLUSIVE);
+}
+
+lock_protocol::status
+lock_client_cache::acquire_exclusive(lock_protocol::lockid_t lid)
+{
+  return acquire_mode(lid, lock_protocol::EXCLUSIVE);
+}
+
+lock_protocol::status
+lock_client_cache::acquire_shared(lock_protocol::lockid_t lid)
+{
+  return acquire_mode(lid, lock_protocol::SHARED);
+}
+
+lock_protocol::status
+lock_client_cache::release(lock_protocol::lockid_t lid)
+{
+  std::unique_lock<std::mutex> l(m);
+  lock_entry *e = get_entry(lid);
+  if (e->writer)
+    e->writer = false;
+  else if (e->nreaders > 0)
+    e->nreaders--;
+  else
+    return lock_protocol::NOENT;
+  // a lapsed hold is gone already; held is NONE, so settle sends nothing
+  if (e->lapsed && !e->writer && e->nreaders == 0)
+    e->lapsed = false;
+
+  hand_off(e);
+  e->refs++;
+  settle(lid, e, l);
+  e->refs--;
+  if (max_cached > 0 && locks.size() > max_cached)
+    trim(l);
+  return lock_protocol::OK;
+}
+
+// Take several locks EXCLUSIVE in ascending id order. Locks this client
+// has no hold on at all go to the server together in one acquire_many;
+// the server grants a prefix of them and queues us for the first busy
+// one, whose grant arrives as a retry like any other.
+lock_protocol::status
+lock_client_cache::acquire_many(std::vector<lock_protocol::lockid_t> lids)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  if (!learn_lease())
+    return lock_protocol::RPCERR;
+  std::unique_lock<std::mutex> l(m);
+  check_lease();
+  // keep trim from freeing any of the entries while we work
+  ref_all(lids, 1);
+  size_t i = 0;
+  while (i < lids.size()) {
+    lock_entry *e = get_entry(lids[i]);
+    if (e->queue.empty() && can_take(e, lock_protocol::EXCLUSIVE, false)) {
+      take(e, lock_protocol::EXCLUSIVE);
+      i++;
+      continue;
+    }
+    if (e->held != lock_protocol::NONE || e->want != lock_protocol::NONE ||
+        e->inflight || e->fetching || e->lapsed || !e->queue.empty()) {
+      // partly held or queued for here already: the one-lock path
+      // knows what to do
+      l.unlock();
+      lock_protocol::status ret = acquire_mode(lids[i], lock_protocol::EXCLUSIVE);
+      l.lock();
+      if (ret != lock_protocol::OK) {
+        ref_all(lids, -1);
+        l.unlock();
+        release_many(std::vector<lock_protocol::lockid_t>(lids.begin(), lids.begin() + i));
+        return ret;
+      }
+      i++;
+      continue;
+    }
+
+    std::vector<lock_protocol::lockid_t> batch;
+    std::vector<lock_entry *> es;
+    for (size_t j = i; j < lids.size(); j++) {
+      lock_entry *f = get_entry(lids[j]);
+      if (f->held != lock_protocol::NONE || f->want != lock_protocol::NONE ||
+          f->inflight || f->fetching || f->lapsed || !f->queue.empty() ||
+          route(lids[j]) != route(lids[i]))
+        break;
+      f->want = lock_protocol::EXCLUSIVE;
+      f->inflight = true;
+      f->fetching = true;
+      batch.push_back(lids[j]);
+      es.push_back(f);
+    }
+
+    l.unlock();
+    int r = 0;
+    lock_protocol::status ret = server_call(route(batch[0]), lock_protocol::acquire_many,
+                                            r, batch);
+    l.lock();
+    size_t granted = ret == lock_protocol::OK ? batch.size() : r;
+    if (ret != lock_protocol::OK && ret != lock_protocol::RETRY)
+      granted = 0;
+    for (size_t j = 0; j < es.size(); j++) {
+      es[j]->inflight = false;
+      if (j < granted) {
+        note_grant(es[j], lock_protocol::EXCLUSIVE);
+        es[j]->want = lock_protocol::NONE;
+        take(es[j], lock_protocol::EXCLUSIVE);
+      } else if (j > granted || ret != lock_protocol::RETRY) {
+        es[j]->want = lock_protocol::NONE;
+      }
+      if (j != granted || ret != lock_protocol::RETRY)
+        es[j]->fetching = false;
+      hand_off(es[j]);
+    }
+    i += granted;
+
+    if (ret == lock_protocol::RETRY) {
+      // queued for batch[granted]; wait for it like request() does
+      settle(lids[i], e = es[granted], l);
+      while (e->want != lock_protocol::NONE)
+        e->wait_cv.wait(l);
+      e->fetching = false;
+      // another local thread may have slipped in; if so, the loop
+      // waits for it like for any other held lock
+      if (e->queue.empty() && can_take(e, lock_protocol::EXCLUSIVE, true)) {
+        take(e, lock_protocol::EXCLUSIVE);
+        i++;
+      }
+      hand_off(e);
+    } else if (ret != lock_protocol::OK) {
+      ref_all(lids, -1);
+      l.unlock();
+      release_many(std::vector<lock_protocol::lockid_t>(lids.begin(), lids.begin() + i));
+      return ret;
+    }
+  }
+  ref_all(lids, -1);
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_client_cache::release_many(std::vector<lock_protocol::lockid_t> lids)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  lock_protocol::status ret = lock_protocol::OK;
+  for (size_t i = lids.size(); i > 0; i--) {
+    if (release(lids[i - 1]) != lock_protocol::OK)
+      ret = lock_protocol::NOENT;
+  }
+  return ret;
+}
+
+rlock_protocol::status
+lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int keep, int &)
+{
+  std::unique_lock<std::mutex> l(m);
+  lock_entry *e = get_entry(lid);
+
+  // the revoke may overtake the reply to our own acquire; remember it
+  // and act on it once the last local holder in the way is done.
+  if (!e->revoked || keep < e->keep)
+    e->keep = keep;
+  if (!e->revoked)
+    e->handoffs = 0;
+  e->revoked = true;
+  e->refs++;
+  settle(lid, e, l);
+  e->refs--;
+  return rlock_protocol::OK;
+}
+
+rlock_protocol::status
+lock_client_cache::retry_handler(lock_protocol::lockid_t lid, int mode, int &)
+{
+  std::unique_lock<std::mutex> l(m);
+  lock_entry *e = get_entry(lid);
+  if (e->want == lock_protocol::NONE)
+    return rlock_protocol::OK;
+
+  note_grant(e, mode);
+  e->want = lock_protocol::NONE;
+  e->wait_cv.notify_all();
+  return rlock_protocol::OK;
+}
+
+// Byte ranges are not cached: each acquire_range is one RPC and each
+// release_range another. The range_granted callback for a RETRY may
+// come in before the RETRY reply itself, so grants are counted rather
+// than flagged. The callback names the range as the server keeps it, so
+// we wait under that name, not the one we asked with.
+lock_protocol::status
+lock_client_cache::acquire_range(lock_protocol::lockid_t lid,
+                                 unsigned long long off,
+                                 unsigned long long len, int mode)
+{
+  int r;
+  lock_protocol::status ret = server_call(route(lid), lock_protocol::acquire_range,
+                                          r, lid, off, len, mode);
+  if (ret != lock_protocol::RETRY)
+    return ret;
+
+  std::unique_lock<std::mutex> l(m);
+  range_key k(lid, off, lock_protocol::range_end(off, len) - off,
+              lock_protocol::range_mode(mode));
+  while (range_grants[k] == 0)
+    range_cv.wait(l);
+  if (--range_grants[k] == 0)
+    range_grants.erase(k);
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_client_cache::release_range(lock_protocol::lockid_t lid,
+                                 unsigned long long off,
+                                 unsigned long long len, int mode)
+{
+  int r;
+  return server_call(route(lid), lock_protocol::release_range, r, lid, off,
+                     len, mode);
+}
+
+rlock_protocol::status
+lock_client_cache::range_granted_handler(lock_protocol::lockid_t lid,
+                                         unsigned long long off,
+                                         unsigned long long len, int mode,
+                                         int &)
+{
+  std::lock_guard<std::mutex> l(m);
+  range_grants[range_key(lid, off, len, mode)]++;
+  range_cv.notify_all();
+  return rlock_protocol::OK;
+}
@@ -0,0 +1,175 @@
+// lock client interface.
+
+#ifndef lock_client_cache_h
+
+#define lock_client_cache_h
+
+#include <string>
+#include <map>
+#include <tuple>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include "lock_protocol.h"
+#include "rpc.h"
+#include "lock_client.h"
+#include "lang/verify.h"
+
+// Classes that inherit lock_release_user can override dorelease so that
+// that they will be called when lock_client releases a lock.
+// It is also called when the lease on a held lock is about to run out.
+// No lock client mutex is held, so dorelease may wait on the network,
+// but it must not call back into the lock client.
+//
+// dolapse is called instead when a lease has run out and the server may
+// already have given the lock away. It runs with the client's mutex
+// held, so it must not block or call back into the lock client.
+class lock_release_user {
+ public:
+  virtual void dorelease(lock_protocol::lockid_t) = 0;
+  virtual void dolapse(lock_protocol::lockid_t) = 0;
+  virtual ~lock_release_user() {};
+};
+
+// A lock client that keeps locks after release. Local threads pass a
+// cached lock between themselves without talking to the server; the
+// lock goes back to lock_server_cache only when the server revokes it.
+//
+// Locks can be taken SHARED (acquire_shared) or EXCLUSIVE (acquire,
+// acquire_exclusive). A thread must not ask for EXCLUSIVE on a lock it
+// already holds SHARED.
+//
+// Each server leases its grants to us. Every answered RPC renews the
+// lease from the time it was sent, and a background thread sends an
+// explicit renew when nothing else has gone to that server for a third
+// of the term. When less than a third is left, that thread has the
+// lock_release_user write back what it holds under the server's locks.
+// If a lease runs out anyway, that server's cached locks are forgotten,
+// since it may have given them away. A lock a local thread still holds
+// is fenced: the holder's release only drops the local hold, and no
+// other thread here gets the lock until the server grants it again.
+// Until a server has told us its lease term no lock is taken at all.
+//
+// Local threads waiting for the same lock queue up in FIFO order, and
+// only the head of the queue ever asks the server, so a lock costs one
+// RPC per client however many threads want it. When the server revokes
+// a lock, up to MAX_HANDOFF more queued threads get it before it goes.
+//
+// Byte-range locks (acquire_range, release_range) bypass the cache and
+// go to the server every time; see lock_server_cache.
+//
+// At most about max_cached locks are kept. Past that, release hands
+// the least recently used idle locks back to the server, the same way
+// it would after a revoke, and frees their entries.
+class lock_client_cache : public lock_client {
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  enum { MAX_HANDOFF = 8 };
+  struct local_waiter {
+    int mode;
+    bool granted;
+    std::condition_variable cv;
+    local_waiter(int m) : mode(m), granted(false) {}
+  };
+  struct lock_entry {
+    int held;         // mode the server has granted this client
+    int want;         // mode requested from the server, NONE if none
+    int nreaders;     // local threads holding the lock SHARED
+    bool writer;      // a local thread holds the lock EXCLUSIVE
+    bool inflight;    // an acquire, release or downgrade RPC is out
+    bool fetching;    // a thread is asking the server, reply and all
+    bool lapsed;      // held by local threads past the lease's end
+    bool revoked;     // the server wants the lock back ...
+    int keep;         // ... down to this mode
+    int handoffs;     // local grants since the revoke
+    int refs;         // threads using the entry while m is dropped
+    unsigned long long last_use;
+    unsigned long long since;   // grant_clock when held last left NONE
+    std::deque<local_waiter *> queue;   // local threads, in arrival order
+    std::condition_variable wait_cv;
+    lock_entry() : held(lock_protocol::NONE), want(lock_protocol::NONE),
+                   nreaders(0), writer(false), inflight(false),
+                   fetching(false), lapsed(false), revoked(false),
+                   keep(lock_protocol::NONE), handoffs(0),
+                   refs(0), last_use(0), since(0) {}
+  };
+
+  class lock_release_user *lu;
+  int rlock_port;
+  std::string hostname;
+  std::string id;
+  std::mutex m;
+  std::map<lock_protocol::lockid_t, lock_entry *> locks;
+  size_t max_cached;
+  unsigned long long use_clock;
+  unsigned long long grant_clock;
+  bool trimming;
+  // seconds, 0 if leases are off, -1 until a server has told us
+  std::atomic<int> lease_term;
+  std::once_flag renewing;
+  // per server: send time of the last RPC it answered
+  std::vector<std::atomic<long long> > lease_start;
+  // range grants called back but not yet picked up by acquire_range
+  typedef std::tuple<lock_protocol::lockid_t, unsigned long long,
+                     unsigned long long, int> range_key;
+  std::map<range_key, int> range_grants;
+  std::condition_variable range_cv;
+
+  lock_entry *get_entry(lock_protocol::lockid_t);
+  static bool can_take(lock_entry *, int mode, bool ignore_revoke);
+  void note_grant(lock_entry *, int mode);
+  void take(lock_entry *, int mode);
+  void hand_off(lock_entry *);
+  static bool unused(lock_entry *);
+  void trim(std::unique_lock<std::mutex> &);
+  void ref_all(const std::vector<lock_protocol::lockid_t> &, int d);
+  lock_protocol::status request(lock_protocol::lockid_t, lock_entry *,
+                                int mode, std::unique_lock<std::mutex> &);
+  void settle(lock_protocol::lockid_t, lock_entry *,
+              std::unique_lock<std::mutex> &);
+  lock_protocol::status acquire_mode(lock_protocol::lockid_t, int mode);
+  bool learn_lease();
+  void renewed(int srv, clock::time_point sent);
+  bool lease_valid(int srv, clock::time_point now);
+  void check_lease();
+  void flush_server(int srv);
+  void renew_loop();
+  template<class... A> lock_protocol::status
+    server_call(int srv, unsigned int proc, int &, const A &...);
+ public:
+  static int last_port;
+  enum { DEFAULT_MAX_CACHED = 4096 };
+  lock_client_cache(std::string xdst, class lock_release_user *l = 0,
+                    size_t max_cached = DEFAULT_MAX_CACHED);
+  virtual ~lock_client_cache() {};
+  lock_protocol::status acquire(lock_protocol::lockid_t);
+  lock_protocol::status acquire_shared(lock_protocol::lockid_t);
+  lock_protocol::status acquire_exclusive(lock_protocol::lockid_t);
+  lock_protocol::status release(lock_protocol::lockid_t);
+  lock_protocol::status acquire_many(std::vector<lock_protocol::lockid_t>);
+  lock_protocol::status release_many(std::vector<lock_protocol::lockid_t>);
+  // Has this client held lid from the server, in use or idle, without
+  // a break since mark() returned m? If so, nobody else has changed
+  // what lid guards in that time.
+  unsigned long long mark();
+  bool held_since(lock_protocol::lockid_t, unsigned long long m);
+  rlock_protocol::status revoke_handler(lock_protocol::lockid_t, int, int &);
+  rlock_protocol::status retry_handler(lock_protocol::lockid_t, int, int &);
+  lock_protocol::status acquire_range(lock_protocol::lockid_t,
+                                      unsigned long long off,
+                                      unsigned long long len, int mode);
+  lock_protocol::status release_range(lock_protocol::lockid_t,
+                                      unsigned long long off,
+                                      unsigned long long len, int mode);
+  rlock_protocol::status range_granted_handler(lock_protocol::lockid_t,
+                                               unsigned long long off,
+                                               unsigned long long len,
+                                               int mode, int &);
+};
+
+
+#endif
@@ -13,18 +13,60 @@
 std::string dst;
 lock_client *lc;
 
+// Upper bound, in microseconds, of the bucket holding the p-th
+// fraction of the samples in hist.
+static unsigned long long
+percentile(const std::vector<unsigned int> &hist, double p)
+{
+  unsigned long long total = 0, seen = 0;
+  for (size_t b = 0; b < hist.size(); b++)
+    total += hist[b];
+  if (total == 0)
+    return 0;
+  for (size_t b = 0; b < hist.size(); b++) {
+    seen += hist[b];
+    if (seen >= p * total)
+      return 2ULL << b;
+  }
+  return 2ULL << (hist.size() - 1);
+}
+
+static void
+print_top(int n)
+{
+  std::vector<lock_protocol::lock_stat> top;
+  if (lc->stat_top(n, top) != lock_protocol::OK) {
+    fprintf(stderr, "stat_top failed\n");
+    exit(1);
+  }
+  printf("%-20s %10s %10s %4s %4s %10s %10s %10s %10s\n", "lock", "acquires",
+         "contended", "hold", "wait", "wait p50", "wait p99", "hold p50",
+         "hold p99");
+  for (size_t i = 0; i < top.size(); i++) {
+    lock_protocol::lock_stat &s = top[i];
+    printf("%-20llu %10llu %10llu %4d %4d %8lluus %8lluus %8lluus %8lluus\n",
+           s.lid, s.acquires, s.contended, s.holders, s.waiters,
+           percentile(s.wait_hist, 0.5), percentile(s.wait_hist, 0.99),
+           percentile(s.hold_hist, 0.5), percentile(s.hold_hist, 0.99));
+  }
+}
+
 int
 main(int argc, char *argv[])
 {
   int r;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s [host:]port\n", argv[0]);
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s [host:]port [top-n]\n", argv[0]);
     exit(1);
   }
 
   dst = argv[1];
   lc = new lock_client(dst);
+  if(argc == 3){
+    print_top(atoi(argv[2]));
+    return 0;
+  }
   r = lc->stat(1);
   printf ("stat returned %d\n", r);
-}
\ No newline at end of file
+}
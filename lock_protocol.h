@@ -4,28 +4,93 @@
 #define lock_protocol_h
 
 #include "rpc.h"
+#include <vector>
 
 class lock_protocol {
 public:
   enum xxstatus { OK, RETRY, RPCERR, NOENT, IOERR };
   typedef int status;
   typedef unsigned long long lockid_t;
+  // Modes a client can hold a lock in. Any number of clients may hold
+  // a lock SHARED at once; EXCLUSIVE excludes everyone else.
+  enum lock_mode { NONE = 0, SHARED, EXCLUSIVE };
   enum rpc_numbers {
     acquire = 0x7001,
     release,
-    stat
+    stat,
+    acquire_shared,
+    downgrade,                    // EXCLUSIVE -> SHARED
+    acquire_many,                 // EXCLUSIVE on a sorted set of locks
+    renew,                        // keep this client's lease alive
+    stat_top,                     // telemetry for the hottest locks
+    acquire_range,                // byte range of a lock, not cached
+    release_range,
+    acquire_exclusive = acquire
   };
+
+  // Per-lock telemetry returned by stat_top. Bucket b of a histogram
+  // counts times of [2^b, 2^(b+1)) microseconds (bucket 0 also has
+  // anything under a microsecond); the last bucket takes everything
+  // longer.
+  enum { NBUCKET = 24 };
+  struct lock_stat {
+    lockid_t lid;
+    unsigned long long acquires;    // acquire requests for the lock
+    unsigned long long contended;   // ... that had to queue
+    int holders;                    // clients holding it now
+    int waiters;                    // clients queued for it now
+    std::vector<unsigned int> wait_hist;   // request to grant
+    std::vector<unsigned int> hold_hist;   // taken to free again
+  };
+
+  // A byte range as lock_server_cache keeps it, and as its range_granted
+  // callback gives it back: the end is clamped to the top of the space
+  // and any mode but SHARED is EXCLUSIVE.
+  static unsigned long long range_end(unsigned long long off,
+                                      unsigned long long len) {
+    return off + len < off ? ~0ULL : off + len;
+  }
+  static int range_mode(int mode) {
+    return mode == SHARED ? SHARED : EXCLUSIVE;
+  }
 };
 
+inline unmarshall &
+operator>>(unmarshall &u, lock_protocol::lock_stat &s)
+{
+  u >> s.lid;
+  u >> s.acquires;
+  u >> s.contended;
+  u >> s.holders;
+  u >> s.waiters;
+  u >> s.wait_hist;
+  u >> s.hold_hist;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, lock_protocol::lock_stat s)
+{
+  m << s.lid;
+  m << s.acquires;
+  m << s.contended;
+  m << s.holders;
+  m << s.waiters;
+  m << s.wait_hist;
+  m << s.hold_hist;
+  return m;
+}
+
 class rlock_protocol {
 public:
   enum xxstatus { OK, RPCERR };
   typedef int status;
   enum rpc_numbers {
-    revoke = 0x8001,
-    retry = 0x8002
+    revoke = 0x8001,  // give the lock back down to the mode passed along
+    retry = 0x8002,   // the lock you were told to RETRY for is now yours
+    range_granted = 0x8003  // ... likewise for a byte range
   };
 };
 
 
-#endif 
\ No newline at end of file
+#endif 
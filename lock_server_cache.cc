@@ -0,0 +1,584 @@
+// the caching lock server implementation
+
+#include "lock_server_cache.h"
+#include <sstream>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <queue>
+#include "lang/verify.h"
+#include "handle.h"
+#include "tprintf.h"
+
+
+lock_server_cache::lock_server_cache(int term):
+  lease_term (term)
+{
+  for (int i = 0; i < NNOTIFIER; i++)
+    std::thread(&lock_server_cache::notifier_loop, this, i).detach();
+  if (lease_term > 0)
+    std::thread(&lock_server_cache::reaper_loop, this).detach();
+}
+
+void
+lock_server_cache::touch(const std::string &id)
+{
+  lease_shard &s = leases[std::hash<std::string>()(id) % NLEASE];
+  std::lock_guard<std::mutex> l(s.m);
+  s.last[id] = clock::now();
+}
+
+bool
+lock_server_cache::lease_live(const std::string &id)
+{
+  if (lease_term <= 0)
+    return true;
+  lease_shard &s = leases[std::hash<std::string>()(id) % NLEASE];
+  std::lock_guard<std::mutex> l(s.m);
+  std::map<std::string, clock::time_point>::iterator it = s.last.find(id);
+  return it != s.last.end() &&
+    clock::now() - it->second <= std::chrono::seconds(lease_term);
+}
+
+// Take the locks of clients whose lease ran out away from them, but
+// only where someone is waiting; an expired client that holds nothing
+// is forgotten.
+void
+lock_server_cache::reaper_loop()
+{
+  while (true) {
+    sleep(lease_term > 1 ? lease_term / 2 : 1);
+
+    std::set<std::string> expired;
+    clock::time_point now = clock::now();
+    for (int k = 0; k < NLEASE; k++) {
+      std::lock_guard<std::mutex> l(leases[k].m);
+      std::map<std::string, clock::time_point>::iterator it;
+      for (it = leases[k].last.begin(); it != leases[k].last.end(); ++it) {
+        if (now - it->second > std::chrono::seconds(lease_term))
+          expired.insert(it->first);
+      }
+    }
+    if (expired.empty())
+      continue;
+
+    reap_ranges(expired);
+
+    std::set<std::string> holding;
+    std::vector<lock_protocol::lockid_t> idle_lids;
+    locks.for_each([&](lock_protocol::lockid_t lid, lock_entry &e) {
+      bool changed = false;
+      std::deque<waiter>::iterator it = e.waiters.begin();
+      while (it != e.waiters.end()) {
+        if (expired.count(it->id)) {
+          it = e.waiters.erase(it);
+          changed = true;
+        } else {
+          ++it;
+        }
+      }
+      if (e.waiters.empty()) {
+        if (changed && idle(e))
+          idle_lids.push_back(lid);
+        if (expired.count(e.owner))
+          holding.insert(e.owner);
+        std::set<std::string>::iterator s;
+        for (s = e.sharers.begin(); s != e.sharers.end(); ++s) {
+          if (expired.count(*s))
+            holding.insert(*s);
+        }
+        return;
+      }
+
+      if (expired.count(e.owner)) {
+        tprintf("lock_server_cache: lease of %s expired, reclaiming %llu\n",
+                e.owner.c_str(), lid);
+        e.owner.clear();
+        changed = true;
+      }
+      std::set<std::string>::iterator s = e.sharers.begin();
+      while (s != e.sharers.end()) {
+        if (expired.count(*s)) {
+          s = e.sharers.erase(s);
+          changed = true;
+        } else {
+          ++s;
+        }
+      }
+      if (changed) {
+        freed(e);
+        e.revoked = false;
+        grant_waiters(lid, e);
+      }
+    });
+
+    // for_each cannot erase as it goes; check again under the shard lock
+    for (size_t i = 0; i < idle_lids.size(); i++) {
+      std::unique_lock<std::mutex> l;
+      lock_entry *e = locks.find(idle_lids[i], l);
+      if (e && idle(*e))
+        locks.erase(idle_lids[i], l);
+    }
+
+    for (std::set<std::string>::iterator it = expired.begin();
+         it != expired.end(); ++it) {
+      if (holding.count(*it))
+        continue;
+      lease_shard &s = leases[std::hash<std::string>()(*it) % NLEASE];
+      std::lock_guard<std::mutex> l(s.m);
+      if (clock::now() - s.last[*it] > std::chrono::seconds(lease_term))
+        s.last.erase(*it);
+    }
+  }
+}
+
+void
+lock_server_cache::notify(unsigned int proc, lock_protocol::lockid_t lid,
+                          std::string id, int mode, unsigned long long off,
+                          unsigned long long len)
+{
+  notifier &n = notifiers[std::hash<std::string>()(id) % NNOTIFIER];
+  std::lock_guard<std::mutex> l(n.m);
+  n.queue.push_back(callback{proc, lid, id, mode, off, len});
+  n.cv.notify_one();
+}
+
+void
+lock_server_cache::notifier_loop(int i)
+{
+  notifier &n = notifiers[i];
+  while (true) {
+    std::unique_lock<std::mutex> l(n.m);
+    while (n.queue.empty())
+      n.cv.wait(l);
+    callback cb = n.queue.front();
+    n.queue.pop_front();
+    l.unlock();
+
+    // the reaper takes back what a client with no lease holds
+    if (!lease_live(cb.id)) {
+      tprintf("lock_server_cache: lease of %s ran out, dropping callback %x for %llu\n",
+              cb.id.c_str(), cb.proc, cb.lid);
+      continue;
+    }
+    handle h(cb.id);
+    rpcc *cl = h.safebind();
+    int r;
+    rlock_protocol::status ret = rlock_protocol::RPCERR;
+    if (cl && cb.proc == rlock_protocol::range_granted)
+      ret = cl->call(cb.proc, cb.lid, cb.off, cb.len, cb.mode, r,
+                     rpcc::to(CALLBACK_TO));
+    else if (cl)
+      ret = cl->call(cb.proc, cb.lid, cb.mode, r, rpcc::to(CALLBACK_TO));
+    if (ret != rlock_protocol::OK)
+      tprintf("lock_server_cache: callback %x for %llu to %s failed\n",
+              cb.proc, cb.lid, cb.id.c_str());
+  }
+}
+
+// Mode in which client id holds the lock.
+int
+lock_server_cache::held(const lock_entry &e, const std::string &id)
+{
+  if (e.owner == id)
+    return lock_protocol::EXCLUSIVE;
+  if (e.sharers.count(id))
+    return lock_protocol::SHARED;
+  return lock_protocol::NONE;
+}
+
+bool
+lock_server_cache::idle(const lock_entry &e)
+{
+  return e.owner.empty() && e.sharers.empty() && e.waiters.empty();
+}
+
+// Could id hold the lock in mode next to the current holders?
+bool
+lock_server_cache::compatible(const lock_entry &e, const std::string &id,
+                              int mode)
+{
+  if (!e.owner.empty() && e.owner != id)
+    return false;
+  if (mode == lock_protocol::SHARED)
+    return true;
+  return e.sharers.empty() || (e.sharers.size() == 1 && e.sharers.count(id));
+}
+
+void
+lock_server_cache::grant(lock_entry &e, const std::string &id, int mode)
+{
+  if (e.owner.empty() && e.sharers.empty())
+    e.stats.busy_since = clock::now();
+  if (mode == lock_protocol::EXCLUSIVE) {
+    e.owner = id;
+    e.sharers.erase(id);
+  } else {
+    e.sharers.insert(id);
+  }
+}
+
+// Called after holders were removed; if none are left, the lock has
+// been held for as long as it is going to be.
+void
+lock_server_cache::freed(lock_entry &e)
+{
+  if (e.owner.empty() && e.sharers.empty())
+    record(e.stats.hold_hist, clock::now() - e.stats.busy_since);
+}
+
+void
+lock_server_cache::record(unsigned int *hist, clock::duration d)
+{
+  long long us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  int b = us < 2 ? 0 : 63 - __builtin_clzll(us);
+  hist[std::min(b, (int) lock_protocol::NBUCKET - 1)]++;
+}
+
+// Ask whoever stands in the way of the first waiter to make room: an
+// owner only has to downgrade if the waiter wants to read, everyone has
+// to let go if it wants to write.
+void
+lock_server_cache::revoke_for_head(lock_protocol::lockid_t lid, lock_entry &e)
+{
+  const waiter &w = e.waiters.front();
+  int keep = w.mode == lock_protocol::SHARED ?
+    lock_protocol::SHARED : lock_protocol::NONE;
+  if (e.revoked && e.revoke_keep <= keep)
+    return;
+  e.revoked = true;
+  e.revoke_keep = keep;
+
+  if (!e.owner.empty() && e.owner != w.id)
+    notify(rlock_protocol::revoke, lid, e.owner, keep);
+  if (w.mode == lock_protocol::EXCLUSIVE) {
+    std::set<std::string>::iterator it;
+    for (it = e.sharers.begin(); it != e.sharers.end(); ++it) {
+      if (*it != w.id)
+        notify(rlock_protocol::revoke, lid, *it, lock_protocol::NONE);
+    }
+  }
+}
+
+// Hand the lock to as many waiters from the head of the queue as the
+// current holders allow; a run of readers is granted in one go.
+void
+lock_server_cache::grant_waiters(lock_protocol::lockid_t lid, lock_entry &e)
+{
+  bool granted = false;
+  while (!e.waiters.empty()) {
+    waiter w = e.waiters.front();
+    if (!compatible(e, w.id, w.mode))
+      break;
+    e.waiters.pop_front();
+    record(e.stats.wait_hist, clock::now() - w.since);
+    grant(e, w.id, w.mode);
+    notify(rlock_protocol::retry, lid, w.id, w.mode);
+    granted = true;
+  }
+  if (granted)
+    e.revoked = false;
+  if (!e.waiters.empty())
+    revoke_for_head(lid, e);
+}
+
+int
+lock_server_cache::acquire_mode(lock_protocol::lockid_t lid, std::string id,
+                                int mode)
+{
+  touch(id);
+  std::unique_lock<std::mutex> l;
+  lock_entry &e = locks.get(lid, l);
+  e.stats.acquires++;
+
+  if (held(e, id) >= mode) {
+    record(e.stats.wait_hist, clock::duration::zero());
+    return lock_protocol::OK;
+  }
+  if (e.waiters.empty() && compatible(e, id, mode)) {
+    record(e.stats.wait_hist, clock::duration::zero());
+    grant(e, id, mode);
+    return lock_protocol::OK;
+  }
+
+  std::deque<waiter>::iterator it;
+  for (it = e.waiters.begin(); it != e.waiters.end(); ++it) {
+    if (it->id == id)
+      break;
+  }
+  if (it == e.waiters.end()) {
+    e.waiters.push_back(waiter{id, mode, clock::now()});
+    e.stats.contended++;
+  } else if (it->mode < mode)
+    it->mode = mode;
+  revoke_for_head(lid, e);
+  return lock_protocol::RETRY;
+}
+
+int lock_server_cache::acquire(lock_protocol::lockid_t lid, std::string id, 
+                               int &)
+{
+  return acquire_mode(lid, id, lock_protocol::EXCLUSIVE);
+}
+
+int
+lock_server_cache::acquire_shared(lock_protocol::lockid_t lid, std::string id,
+                                  int &)
+{
+  return acquire_mode(lid, id, lock_protocol::SHARED);
+}
+
+// Grant the locks EXCLUSIVE in ascending id order, stopping at the
+// first one that is busy: the client is queued for that one and told to
+// RETRY, with r set to the number granted before it. Since every client
+// takes locks in the same order, nobody can hold a later lock while
+// waiting for an earlier one, and an uncontended set costs one RPC.
+int
+lock_server_cache::acquire_many(std::vector<lock_protocol::lockid_t> lids,
+                                std::string id, int &r)
+{
+  std::sort(lids.begin(), lids.end());
+  lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+  for (r = 0; r < (int) lids.size(); r++) {
+    int ret = acquire_mode(lids[r], id, lock_protocol::EXCLUSIVE);
+    if (ret != lock_protocol::OK)
+      return ret;
+  }
+  return lock_protocol::OK;
+}
+
+int 
+lock_server_cache::release(lock_protocol::lockid_t lid, std::string id, 
+         int &r)
+{
+  touch(id);
+  std::unique_lock<std::mutex> l;
+  lock_entry *e = locks.find(lid, l);
+  if (e == NULL || held(*e, id) == lock_protocol::NONE)
+    return lock_protocol::OK;
+
+  if (e->owner == id)
+    e->owner.clear();
+  e->sharers.erase(id);
+  freed(*e);
+  grant_waiters(lid, *e);
+  if (idle(*e))
+    locks.erase(lid, l);
+  return lock_protocol::OK;
+}
+
+int
+lock_server_cache::downgrade(lock_protocol::lockid_t lid, std::string id,
+                             int &r)
+{
+  touch(id);
+  std::unique_lock<std::mutex> l;
+  lock_entry *e = locks.find(lid, l);
+  if (e == NULL || e->owner != id)
+    return lock_protocol::OK;
+
+  e->owner.clear();
+  e->sharers.insert(id);
+  grant_waiters(lid, *e);
+  return lock_protocol::OK;
+}
+
+// Must a range wait, because it clashes with a held range or with one
+// of the first nbefore queued ones?
+bool
+lock_server_cache::range_blocked(const range_entry &e,
+                                 const interval_tree::interval &iv,
+                                 size_t nbefore)
+{
+  if (e.held.conflicts(iv.off, iv.end, iv.mode))
+    return true;
+  for (size_t k = 0; k < nbefore; k++) {
+    const interval_tree::interval &w = e.waiters[k];
+    if (w.off < iv.end && iv.off < w.end &&
+        (w.mode == lock_protocol::EXCLUSIVE || iv.mode == lock_protocol::EXCLUSIVE))
+      return true;
+  }
+  return false;
+}
+
+// Grant every queued range that no longer has to wait. A range only
+// waits for clashing ranges queued before it, so disjoint ones go
+// ahead of a blocked one.
+void
+lock_server_cache::grant_ranges(lock_protocol::lockid_t lid, range_entry &e)
+{
+  size_t k = 0;
+  while (k < e.waiters.size()) {
+    if (range_blocked(e, e.waiters[k], k)) {
+      k++;
+      continue;
+    }
+    interval_tree::interval iv = e.waiters[k];
+    e.waiters.erase(e.waiters.begin() + k);
+    e.held.insert(iv);
+    notify(rlock_protocol::range_granted, lid, iv.id, iv.mode, iv.off,
+           iv.end - iv.off);
+  }
+}
+
+// Ranges are only held for the length of one operation, so an expired
+// client's ranges are dropped whether or not anyone waits for them.
+void
+lock_server_cache::reap_ranges(const std::set<std::string> &expired)
+{
+  std::vector<lock_protocol::lockid_t> empty_lids;
+  ranges.for_each([&](lock_protocol::lockid_t lid, range_entry &e) {
+    std::vector<interval_tree::interval> dead;
+    e.held.for_each([&](const interval_tree::interval &iv) {
+      if (expired.count(iv.id))
+        dead.push_back(iv);
+    });
+    for (size_t i = 0; i < dead.size(); i++)
+      e.held.erase(dead[i]);
+    std::deque<interval_tree::interval>::iterator it = e.waiters.begin();
+    while (it != e.waiters.end()) {
+      if (expired.count(it->id))
+        it = e.waiters.erase(it);
+      else
+        ++it;
+    }
+    grant_ranges(lid, e);
+    if (e.held.empty() && e.waiters.empty())
+      empty_lids.push_back(lid);
+  });
+  for (size_t i = 0; i < empty_lids.size(); i++) {
+    std::unique_lock<std::mutex> l;
+    range_entry *e = ranges.find(empty_lids[i], l);
+    if (e && e->held.empty() && e->waiters.empty())
+      ranges.erase(empty_lids[i], l);
+  }
+}
+
+int
+lock_server_cache::acquire_range(lock_protocol::lockid_t lid,
+                                 unsigned long long off,
+                                 unsigned long long len, int mode,
+                                 std::string id, int &)
+{
+  touch(id);
+  if (len == 0)
+    return lock_protocol::OK;
+  interval_tree::interval iv;
+  iv.off = off;
+  iv.end = lock_protocol::range_end(off, len);
+  iv.mode = lock_protocol::range_mode(mode);
+  iv.id = id;
+
+  std::unique_lock<std::mutex> l;
+  range_entry &e = ranges.get(lid, l);
+  if (!range_blocked(e, iv, e.waiters.size())) {
+    e.held.insert(iv);
+    return lock_protocol::OK;
+  }
+  e.waiters.push_back(iv);
+  return lock_protocol::RETRY;
+}
+
+int
+lock_server_cache::release_range(lock_protocol::lockid_t lid,
+                                 unsigned long long off,
+                                 unsigned long long len, int mode,
+                                 std::string id, int &)
+{
+  touch(id);
+  if (len == 0)
+    return lock_protocol::OK;
+  interval_tree::interval iv;
+  iv.off = off;
+  iv.end = lock_protocol::range_end(off, len);
+  iv.mode = lock_protocol::range_mode(mode);
+  iv.id = id;
+
+  std::unique_lock<std::mutex> l;
+  range_entry *e = ranges.find(lid, l);
+  if (e == NULL || !e->held.erase(iv))
+    return lock_protocol::NOENT;
+  grant_ranges(lid, *e);
+  if (e->held.empty() && e->waiters.empty())
+    ranges.erase(lid, l);
+  return lock_protocol::OK;
+}
+
+// Nothing to do but note that the client is alive; every other RPC from
+// it does the same. Tells the client how long a lease lasts.
+int
+lock_server_cache::renew(std::string id, int &term)
+{
+  touch(id);
+  term = lease_term;
+  return lock_protocol::OK;
+}
+
+lock_protocol::status
+lock_server_cache::stat(int clt, lock_protocol::lockid_t lid, int &r)
+{
+  tprintf("stat request\n");
+  std::unique_lock<std::mutex> l;
+  lock_entry *e = locks.find(lid, l);
+  r = e ? e->stats.acquires : 0;
+  return lock_protocol::OK;
+}
+
+size_t
+lock_server_cache::table_size()
+{
+  return locks.size();
+}
+
+size_t
+lock_server_cache::table_capacity()
+{
+  return locks.capacity();
+}
+
+// The n hottest locks, most contended first; acquires break ties.
+int
+lock_server_cache::stat_top(int n, std::vector<lock_protocol::lock_stat> &r)
+{
+  typedef std::pair<std::pair<unsigned long long, unsigned long long>,
+                    lock_protocol::lock_stat> ranked;
+  struct hotter {
+    bool operator()(const ranked &a, const ranked &b) const {
+      return a.first > b.first;
+    }
+  };
+  // min-heap of the best n seen so far
+  std::priority_queue<ranked, std::vector<ranked>, hotter> top;
+
+  locks.for_each([&](lock_protocol::lockid_t lid, lock_entry &e) {
+    if (n <= 0 || e.stats.acquires == 0)
+      return;
+    std::pair<unsigned long long, unsigned long long> key(e.stats.contended,
+                                                          e.stats.acquires);
+    if ((int) top.size() == n && !(key > top.top().first))
+      return;
+    lock_protocol::lock_stat s;
+    s.lid = lid;
+    s.acquires = e.stats.acquires;
+    s.contended = e.stats.contended;
+    s.holders = e.sharers.size() + (e.owner.empty() ? 0 : 1);
+    s.waiters = e.waiters.size();
+    s.wait_hist.assign(e.stats.wait_hist, e.stats.wait_hist + lock_protocol::NBUCKET);
+    s.hold_hist.assign(e.stats.hold_hist, e.stats.hold_hist + lock_protocol::NBUCKET);
+    top.push(ranked(key, s));
+    if ((int) top.size() > n)
+      top.pop();
+  });
+
+  r.resize(top.size());
+  for (size_t i = r.size(); i > 0; i--) {
+    r[i - 1] = top.top().second;
+    top.pop();
+  }
+  return lock_protocol::OK;
+}
+
@@ -0,0 +1,145 @@
+#ifndef lock_server_cache_h
+#define lock_server_cache_h
+
+#include <string>
+#include <set>
+#include <map>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "lock_protocol.h"
+#include "rpc.h"
+#include "lock_table.h"
+#include "interval_tree.h"
+
+
+// Lock server for caching clients. A lock stays with its holders until
+// some other client asks for it; the server then sends the holders a
+// revoke. acquire never blocks: a busy lock answers RETRY and queues
+// the client, and the server later hands the lock to the head of the
+// queue and tells it so with a retry.
+//
+// A lock is held either EXCLUSIVE by one owner or SHARED by a set of
+// sharers. When the lock frees up, all shared waiters at the head of
+// the queue are granted together. A sharer asking for EXCLUSIVE is an
+// upgrade; an owner that only has to make room for readers is asked to
+// downgrade rather than to give the lock up.
+//
+// Each client holds a lease of lease_term seconds on everything it has
+// been granted. Any RPC from the client renews it. Once it runs out,
+// the client's locks that others are waiting for are taken back and
+// handed on, so a crashed or wedged client cannot stall the rest.
+//
+// A lock id also carries byte-range locks, which are separate from the
+// whole lock and not cached: a client asks for [off, off+len) in SHARED
+// or EXCLUSIVE mode each time and hands it back with release_range. A
+// range that clashes with a held one, or with an earlier queued one,
+// waits and is later granted with a range_granted callback. Ranges of
+// a client whose lease ran out are taken back outright.
+//
+// The entry for a lock is dropped as soon as nobody holds or waits for
+// it, so the table only holds locks that are cached or contended; the
+// telemetry of a lock starts over when it comes back.
+class lock_server_cache {
+ private:
+  typedef std::chrono::steady_clock clock;
+  struct waiter {
+    std::string id;
+    int mode;
+    clock::time_point since;          // when it was queued
+  };
+  struct lock_stats {
+    unsigned long long acquires;
+    unsigned long long contended;
+    unsigned int wait_hist[lock_protocol::NBUCKET];
+    unsigned int hold_hist[lock_protocol::NBUCKET];
+    clock::time_point busy_since;     // last time the lock was taken
+    lock_stats() : acquires(0), contended(0), wait_hist(), hold_hist() {}
+  };
+  struct lock_entry {
+    std::string owner;                // EXCLUSIVE holder, "" if none
+    std::set<std::string> sharers;    // SHARED holders
+    std::deque<waiter> waiters;       // clients told RETRY, in arrival order
+    bool revoked;                     // holders already asked to make room
+    int revoke_keep;                  // ... down to this mode
+    lock_stats stats;
+    lock_entry() : revoked(false), revoke_keep(lock_protocol::NONE) {}
+  };
+
+  // Callbacks go out on a few notifier threads so that no RPC handler
+  // waits on a client. A client always maps to the same notifier, so
+  // it sees its callbacks in the order they were queued. None go to a
+  // client whose lease has run out, and each gives up after CALLBACK_TO
+  // ms, so a dead client stalls the others on its notifier no longer.
+  struct callback {
+    unsigned int proc;   // rlock_protocol::revoke, retry or range_granted
+    lock_protocol::lockid_t lid;
+    std::string id;
+    int mode;
+    unsigned long long off, len;   // range_granted only
+  };
+  struct notifier {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<callback> queue;
+  };
+  enum { NNOTIFIER = 4, CALLBACK_TO = 1000 };
+
+  struct alignas(64) lease_shard {
+    std::mutex m;
+    std::map<std::string, clock::time_point> last;   // last RPC per client
+  };
+  enum { NLEASE = 16 };
+
+  int lease_term;
+  struct range_entry {
+    interval_tree held;
+    std::deque<interval_tree::interval> waiters;
+  };
+
+  lock_table<lock_entry> locks;
+  lock_table<range_entry> ranges;
+  notifier notifiers[NNOTIFIER];
+  lease_shard leases[NLEASE];
+
+  void notify(unsigned int proc, lock_protocol::lockid_t, std::string id, int mode,
+              unsigned long long off = 0, unsigned long long len = 0);
+  void notifier_loop(int);
+  void touch(const std::string &id);
+  bool lease_live(const std::string &id);
+  void reaper_loop();
+
+  static int held(const lock_entry &, const std::string &id);
+  static bool idle(const lock_entry &);
+  static bool compatible(const lock_entry &, const std::string &id, int mode);
+  static void grant(lock_entry &, const std::string &id, int mode);
+  static void freed(lock_entry &);
+  static void record(unsigned int *hist, clock::duration);
+  void revoke_for_head(lock_protocol::lockid_t, lock_entry &);
+  void grant_waiters(lock_protocol::lockid_t, lock_entry &);
+  int acquire_mode(lock_protocol::lockid_t, std::string id, int mode);
+  static bool range_blocked(const range_entry &,
+                            const interval_tree::interval &, size_t nbefore);
+  void grant_ranges(lock_protocol::lockid_t, range_entry &);
+  void reap_ranges(const std::set<std::string> &expired);
+ public:
+  enum { DEFAULT_LEASE = 10 };
+  lock_server_cache(int lease_term = DEFAULT_LEASE);
+  lock_protocol::status stat(int clt, lock_protocol::lockid_t, int &);
+  int acquire(lock_protocol::lockid_t, std::string id, int &);
+  int acquire_shared(lock_protocol::lockid_t, std::string id, int &);
+  int acquire_many(std::vector<lock_protocol::lockid_t>, std::string id, int &);
+  int release(lock_protocol::lockid_t, std::string id, int &);
+  int downgrade(lock_protocol::lockid_t, std::string id, int &);
+  int acquire_range(lock_protocol::lockid_t, unsigned long long off,
+                    unsigned long long len, int mode, std::string id, int &);
+  int release_range(lock_protocol::lockid_t, unsigned long long off,
+                    unsigned long long len, int mode, std::string id, int &);
+  int renew(std::string id, int &);
+  int stat_top(int n, std::vector<lock_protocol::lock_stat> &);
+  size_t table_size();
+  size_t table_capacity();
+};
+
+#endif
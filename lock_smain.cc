@@ -2,7 +2,7 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include "lock_server.h"
+#include "lock_server_cache.h"
 #include <unistd.h>
 #include "jsl_log.h"
 
@@ -18,8 +18,10 @@ main(int argc, char *argv[])
 
   srandom(getpid());
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  // start.sh passes the first server's port ahead of our own when it
+  // starts several; we only need our own.
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s [first-port] port\n", argv[0]);
     exit(1);
   }
 
@@ -28,13 +30,26 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
+  int lease = lock_server_cache::DEFAULT_LEASE;
+  char *lease_env = getenv("LOCK_LEASE");
+  if(lease_env != NULL){
+    lease = atoi(lease_env);
+  }
+
   //jsl_set_debug(2);
 
-  lock_server ls;
-  rpcs server(atoi(argv[1]), count);
-  server.reg(lock_protocol::stat, &ls, &lock_server::stat);
-  server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
-  server.reg(lock_protocol::release, &ls, &lock_server::release);
+  lock_server_cache ls(lease);
+  rpcs server(atoi(argv[argc-1]), count);
+  server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat);
+  server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire);
+  server.reg(lock_protocol::acquire_shared, &ls, &lock_server_cache::acquire_shared);
+  server.reg(lock_protocol::acquire_many, &ls, &lock_server_cache::acquire_many);
+  server.reg(lock_protocol::release, &ls, &lock_server_cache::release);
+  server.reg(lock_protocol::downgrade, &ls, &lock_server_cache::downgrade);
+  server.reg(lock_protocol::renew, &ls, &lock_server_cache::renew);
+  server.reg(lock_protocol::stat_top, &ls, &lock_server_cache::stat_top);
+  server.reg(lock_protocol::acquire_range, &ls, &lock_server_cache::acquire_range);
+  server.reg(lock_protocol::release_range, &ls, &lock_server_cache::release_range);
 
   while(1)
     sleep(1000);
@@ -0,0 +1,204 @@
+// per-lock state table for the lock server
+
+#ifndef lock_table_h
+#define lock_table_h
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include "lock_protocol.h"
+#include "lang/verify.h"
+
+// A hash table from lockid_t to T, split into NSHARD shards. Each shard
+// sits on its own cache lines with its own mutex, so handlers working on
+// different locks rarely touch the same mutex or line. Inside a shard
+// the entries live in one array with linear probing, so a lookup is a
+// hash and a short scan rather than a walk down a tree of pointers.
+//
+// Entries are only ever touched with their shard locked, so an entry can
+// be erased as soon as its owner sees it is idle: no reference to it can
+// outlive the shard lock. Erasing shifts the rest of the probe run back
+// instead of leaving tombstones, and a shard shrinks again once it is
+// mostly empty, so memory follows the number of live entries.
+template<class T>
+class lock_table {
+ public:
+  enum { NSHARD = 64 };
+
+ private:
+  struct slot {
+    lock_protocol::lockid_t lid;
+    bool used;
+    T val;
+    slot() : lid(0), used(false) {}
+  };
+  struct alignas(64) shard {
+    std::mutex m;
+    std::vector<slot> slots;   // size is a power of two
+    size_t count;
+    shard() : slots(16), count(0) {}
+  };
+  shard shards[NSHARD];
+
+  static uint64_t hash(lock_protocol::lockid_t lid) {
+    uint64_t x = lid + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+  static size_t probe(const shard &s, lock_protocol::lockid_t lid, uint64_t h);
+  static void resize(shard &s, size_t n);
+
+ public:
+  // Lock the shard holding lid into l and return the entry for lid,
+  // creating a default one first if needed. The reference stays valid
+  // for as long as l is held.
+  T &get(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l);
+
+  // Like get, but returns NULL rather than creating a missing entry.
+  T *find(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l);
+
+  // Remove lid's entry. l must hold lid's shard, as left by get or
+  // find; references to entries of that shard are invalid afterwards.
+  void erase(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l);
+
+  // Call f(lid, entry) for every entry, locking one shard at a time.
+  template<class F> void for_each(F f);
+  size_t size();
+  // slots allocated over all shards, used or not
+  size_t capacity();
+};
+
+// Index of lid's slot, or of the empty slot where it would go.
+template<class T>
+size_t
+lock_table<T>::probe(const shard &s, lock_protocol::lockid_t lid, uint64_t h)
+{
+  size_t mask = s.slots.size() - 1;
+  size_t i = h & mask;
+  while (s.slots[i].used && s.slots[i].lid != lid)
+    i = (i + 1) & mask;
+  return i;
+}
+
+template<class T>
+void
+lock_table<T>::resize(shard &s, size_t n)
+{
+  std::vector<slot> old(n);
+  old.swap(s.slots);
+  for (size_t i = 0; i < old.size(); i++) {
+    if (!old[i].used)
+      continue;
+    slot &n = s.slots[probe(s, old[i].lid, hash(old[i].lid))];
+    n.lid = old[i].lid;
+    n.used = true;
+    n.val = std::move(old[i].val);
+  }
+}
+
+template<class T>
+T &
+lock_table<T>::get(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l)
+{
+  uint64_t h = hash(lid);
+  shard &s = shards[h >> 58];
+  l = std::unique_lock<std::mutex>(s.m);
+
+  size_t i = probe(s, lid, h);
+  if (s.slots[i].used)
+    return s.slots[i].val;
+
+  // keep the load factor under 3/4 so probe sequences stay short
+  if ((s.count + 1) * 4 > s.slots.size() * 3) {
+    resize(s, s.slots.size() * 2);
+    i = probe(s, lid, h);
+  }
+  s.slots[i].lid = lid;
+  s.slots[i].used = true;
+  s.count++;
+  return s.slots[i].val;
+}
+
+template<class T>
+T *
+lock_table<T>::find(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l)
+{
+  uint64_t h = hash(lid);
+  shard &s = shards[h >> 58];
+  l = std::unique_lock<std::mutex>(s.m);
+
+  size_t i = probe(s, lid, h);
+  return s.slots[i].used ? &s.slots[i].val : NULL;
+}
+
+template<class T>
+void
+lock_table<T>::erase(lock_protocol::lockid_t lid, std::unique_lock<std::mutex> &l)
+{
+  uint64_t h = hash(lid);
+  shard &s = shards[h >> 58];
+  VERIFY(l.owns_lock() && l.mutex() == &s.m);
+
+  size_t mask = s.slots.size() - 1;
+  size_t i = probe(s, lid, h);
+  if (!s.slots[i].used)
+    return;
+
+  // Pull later members of the probe run into the hole, unless that
+  // would move one in front of its home slot.
+  for (size_t j = (i + 1) & mask; s.slots[j].used; j = (j + 1) & mask) {
+    size_t home = hash(s.slots[j].lid) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      s.slots[i].lid = s.slots[j].lid;
+      s.slots[i].val = std::move(s.slots[j].val);
+      i = j;
+    }
+  }
+  s.slots[i].used = false;
+  s.slots[i].val = T();
+  s.count--;
+
+  if (s.slots.size() > 16 && s.count * 8 < s.slots.size())
+    resize(s, s.slots.size() / 2);
+}
+
+template<class T>
+template<class F>
+void
+lock_table<T>::for_each(F f)
+{
+  for (int k = 0; k < NSHARD; k++) {
+    std::lock_guard<std::mutex> l(shards[k].m);
+    for (size_t i = 0; i < shards[k].slots.size(); i++) {
+      if (shards[k].slots[i].used)
+        f(shards[k].slots[i].lid, shards[k].slots[i].val);
+    }
+  }
+}
+
+template<class T>
+size_t
+lock_table<T>::size()
+{
+  size_t n = 0;
+  for (int k = 0; k < NSHARD; k++) {
+    std::lock_guard<std::mutex> l(shards[k].m);
+    n += shards[k].count;
+  }
+  return n;
+}
+
+template<class T>
+size_t
+lock_table<T>::capacity()
+{
+  size_t n = 0;
+  for (int k = 0; k < NSHARD; k++) {
+    std::lock_guard<std::mutex> l(shards[k].m);
+    n += shards[k].slots.size();
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,145 @@
+//
+// In-process lock server microbenchmark: uncontended acquire/release
+// throughput of lock_server_cache as the number of threads grows.
+// Given a churn count, it then cycles that many distinct lock ids
+// through the server, none used twice, and checks that the table ends
+// up empty and holds no more slots than before the churn.
+//
+
+#include "lock_protocol.h"
+#include "lock_server_cache.h"
+#include <vector>
+#include <sstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "lang/verify.h"
+
+lock_server_cache *ls;
+int nlocks = 1024;          // distinct lock ids per thread
+long long nchurn = 0;       // ids per thread in the churn run
+double duration = 1.0;      // seconds per run
+volatile bool stop;
+
+struct worker {
+  int i;
+  unsigned long long ops;
+};
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *
+run(void *x)
+{
+  worker *w = (worker *) x;
+  std::ostringstream ost;
+  ost << "127.0.0.1:" << (10000 + w->i);
+  std::string id = ost.str();
+  // each thread works on its own ids, so no acquire ever waits
+  lock_protocol::lockid_t base = (lock_protocol::lockid_t) w->i << 32;
+  int r;
+
+  while (!stop) {
+    for (int j = 0; j < nlocks; j++) {
+      VERIFY(ls->acquire(base + j, id, r) == lock_protocol::OK);
+      ls->release(base + j, id, r);
+    }
+    w->ops += nlocks;
+  }
+  return 0;
+}
+
+void *
+churn(void *x)
+{
+  worker *w = (worker *) x;
+  std::ostringstream ost;
+  ost << "127.0.0.1:" << (20000 + w->i);
+  std::string id = ost.str();
+  lock_protocol::lockid_t base = (lock_protocol::lockid_t) (w->i + 1) << 40;
+  int r;
+
+  for (long long j = 0; j < nchurn; j++) {
+    VERIFY(ls->acquire(base + j, id, r) == lock_protocol::OK);
+    ls->release(base + j, id, r);
+  }
+  w->ops = nchurn;
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int maxthreads = 8;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  if (argc > 1)
+    maxthreads = atoi(argv[1]);
+  if (argc > 2)
+    nlocks = atoi(argv[2]);
+  if (argc > 3)
+    nchurn = atoll(argv[3]);
+  if (maxthreads < 1 || nlocks < 1 || nchurn < 0) {
+    fprintf(stderr, "Usage: %s [max-threads] [locks-per-thread] [churn-ids]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  ls = new lock_server_cache();
+  double base = 0;
+  printf("%8s %16s %8s\n", "threads", "acquires/sec", "speedup");
+  for (int nt = 1; nt <= maxthreads; nt *= 2) {
+    std::vector<pthread_t> th(nt);
+    std::vector<worker> w(nt);
+    stop = false;
+    double start = now();
+    for (int i = 0; i < nt; i++) {
+      w[i].i = i;
+      w[i].ops = 0;
+      VERIFY(pthread_create(&th[i], NULL, run, (void *) &w[i]) == 0);
+    }
+    while (now() - start < duration)
+      usleep(10000);
+    stop = true;
+    unsigned long long ops = 0;
+    for (int i = 0; i < nt; i++) {
+      pthread_join(th[i], NULL);
+      ops += w[i].ops;
+    }
+    double rate = ops / (now() - start);
+    if (nt == 1)
+      base = rate;
+    printf("%8d %16.0f %8.2f\n", nt, rate, rate / base);
+    if (nt < maxthreads && nt * 2 > maxthreads)
+      nt = maxthreads / 2;
+  }
+
+  if (nchurn == 0)
+    return 0;
+  size_t slots = ls->table_capacity();
+  std::vector<pthread_t> th(maxthreads);
+  std::vector<worker> w(maxthreads);
+  double start = now();
+  for (int i = 0; i < maxthreads; i++) {
+    w[i].i = i;
+    w[i].ops = 0;
+    VERIFY(pthread_create(&th[i], NULL, churn, (void *) &w[i]) == 0);
+  }
+  for (int i = 0; i < maxthreads; i++)
+    pthread_join(th[i], NULL);
+  double t = now() - start;
+  printf("churned %lld ids in %.1fs (%.0f/sec), %lu entries left, "
+         "%lu -> %lu slots\n", nchurn * maxthreads, t,
+         nchurn * maxthreads / t, (unsigned long) ls->table_size(),
+         (unsigned long) slots, (unsigned long) ls->table_capacity());
+  VERIFY(ls->table_size() == 0);
+  VERIFY(ls->table_capacity() <= slots);
+}
@@ -4,16 +4,19 @@
 
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_client_cache.h"
 #include "rpc.h"
 #include "jsl_log.h"
 #include <arpa/inet.h>
 #include <vector>
+#include <sstream>
 #include <stdlib.h>
 #include <stdio.h>
 #include "lang/verify.h"
 #include <unistd.h>
+#include <time.h>
 // must be >= 2
-int nt = 6; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
+int nt = 10; // acquire never blocks in the server, so nt is not bounded by the rpcs thread pool
 std::string dst;
 lock_client **lc = new lock_client * [nt];
 lock_protocol::lockid_t a = 1;
@@ -24,6 +27,7 @@ lock_protocol::lockid_t c = 3;
 // doesn't grant the same lock to both clients.
 // it assumes that lock names are distinct in the first byte.
 int ct[256];
+int rct[256];   // shared holders
 pthread_mutex_t count_mutex;
 
 void
@@ -31,7 +35,7 @@ check_grant(lock_protocol::lockid_t lid)
 {
   ScopedLock ml(&count_mutex);
   int x = lid & 0xff;
-  if(ct[x] != 0){
+  if(ct[x] != 0 || rct[x] != 0){
     fprintf(stderr, "error: server granted %016llx twice\n", lid);
     fprintf(stdout, "error: server granted %016llx twice\n", lid);
     exit(1);
@@ -39,6 +43,31 @@ check_grant(lock_protocol::lockid_t lid)
   ct[x] += 1;
 }
 
+void
+check_grant_shared(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&count_mutex);
+  int x = lid & 0xff;
+  if(ct[x] != 0){
+    fprintf(stderr, "error: server granted %016llx shared while held exclusive\n", lid);
+    fprintf(stdout, "error: server granted %016llx shared while held exclusive\n", lid);
+    exit(1);
+  }
+  rct[x] += 1;
+}
+
+void
+check_release_shared(lock_protocol::lockid_t lid)
+{
+  ScopedLock ml(&count_mutex);
+  int x = lid & 0xff;
+  if(rct[x] < 1){
+    fprintf(stderr, "error: client released un-held shared lock %016llx\n",  lid);
+    exit(1);
+  }
+  rct[x] -= 1;
+}
+
 void
 check_release(lock_protocol::lockid_t lid)
 {
@@ -142,6 +171,221 @@ test5(void *x)
   return 0;
 }
 
+void *
+test6(void *x)
+{
+  int i = * (int *) x;
+  lock_client_cache *c = (lock_client_cache *) lc[i % 2];
+
+  printf ("test6: client %d acquire a shared/exclusive concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    if ((i + j) % 3 == 0) {
+      c->acquire_exclusive(a);
+      check_grant(a);
+      check_release(a);
+    } else {
+      c->acquire_shared(a);
+      check_grant_shared(a);
+      usleep(1000);
+      check_release_shared(a);
+    }
+    c->release(a);
+  }
+  return 0;
+}
+
+void *
+test7(void *x)
+{
+  int i = * (int *) x;
+  lock_client_cache *cc = (lock_client_cache *) lc[i % 2];
+
+  printf ("test7: client %d acquire_many a b c concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    if (j % 2) {
+      cc->acquire_many({c, a, b});
+      check_grant(a);
+      check_grant(b);
+      check_grant(c);
+      check_release(c);
+      check_release(b);
+      check_release(a);
+      cc->release_many({a, b, c});
+    } else {
+      cc->acquire(b);
+      check_grant(b);
+      check_release(b);
+      cc->release(b);
+    }
+  }
+  return 0;
+}
+
+// test8: byte ranges of lock a. Slot i (bytes [100*i, 100*i+100))
+// is written by threads i and i+nt/2 only, so writers of the same slot
+// exclude each other while the other slots go on at once. Every
+// thread also reads the first two slots, so reads overlap writes.
+int slot_writers[256];
+int slot_readers[256];
+
+void *
+test8(void *x)
+{
+  int i = * (int *) x;
+  lock_client_cache *cc = (lock_client_cache *) lc[i];
+  int s = i % (nt / 2);
+
+  printf ("test8: client %d byte ranges of a concurrent\n", i);
+  for (int j = 0; j < 10; j++) {
+    cc->acquire_range(a, 100 * s, 100, lock_protocol::EXCLUSIVE);
+    {
+      ScopedLock ml(&count_mutex);
+      if (slot_writers[s] != 0 || (s < 2 && slot_readers[s] != 0)) {
+        fprintf(stderr, "error: range %d granted twice\n", s);
+        fprintf(stdout, "error: range %d granted twice\n", s);
+        exit(1);
+      }
+      slot_writers[s]++;
+    }
+    usleep(1000);
+    {
+      ScopedLock ml(&count_mutex);
+      slot_writers[s]--;
+    }
+    cc->release_range(a, 100 * s, 100, lock_protocol::EXCLUSIVE);
+
+    cc->acquire_range(a, 0, 200, lock_protocol::SHARED);
+    {
+      ScopedLock ml(&count_mutex);
+      if (slot_writers[0] != 0 || slot_writers[1] != 0) {
+        fprintf(stderr, "error: range 0-200 granted shared while written\n");
+        fprintf(stdout, "error: range 0-200 granted shared while written\n");
+        exit(1);
+      }
+      slot_readers[0]++;
+      slot_readers[1]++;
+    }
+    usleep(1000);
+    {
+      ScopedLock ml(&count_mutex);
+      slot_readers[0]--;
+      slot_readers[1]--;
+    }
+    cc->release_range(a, 0, 200, lock_protocol::SHARED);
+  }
+  return 0;
+}
+
+// test9: a client that takes a lock and then goes silent, renewing no
+// lease and answering no revoke, loses the lock once its lease runs
+// out. Only run when asked for by number, against a server started
+// with a short LOCK_LEASE, since it waits out a whole term.
+class silent_client : public lock_client {
+ public:
+  silent_client(std::string d) : lock_client(d) {}
+  lock_protocol::status acquire(lock_protocol::lockid_t lid) {
+    int r;
+    // nobody listens there, so callbacks to it fail
+    return server(lid)->call(lock_protocol::acquire, lid,
+                             std::string("127.0.0.1:1"), r);
+  }
+};
+
+void
+test9(void)
+{
+  lock_protocol::lockid_t d = 4;
+  silent_client s(dst);
+
+  printf("test9: a silent client's lock is taken back when its lease runs out\n");
+  if (s.acquire(d) != lock_protocol::OK) {
+    fprintf(stderr, "error: silent client could not take %016llx\n", d);
+    exit(1);
+  }
+  time_t t0 = time(0);
+  // a revoke queued for the silent client holds up nobody else
+  for (int i = 0; i < nt; i++) {
+    lc[i]->acquire(a);
+    check_grant(a);
+    check_release(a);
+    lc[i]->release(a);
+  }
+  lc[0]->acquire(d);
+  check_grant(d);
+  printf("test9: reclaimed after %ds\n", (int) (time(0) - t0));
+  check_release(d);
+  lc[0]->release(d);
+}
+
+// test10: the hash ring spreads ids evenly over the lock servers, and
+// a fifth server takes ids only from the other four, about a fifth of
+// them. Needs no server.
+void
+test10(void)
+{
+  std::vector<std::string> four, five;
+  for (int i = 0; i < 5; i++) {
+    std::ostringstream ost;
+    ost << "127.0.0.1:" << (3780 + 2 * i);
+    if (i < 4)
+      four.push_back(ost.str());
+    five.push_back(ost.str());
+  }
+  hash_ring r4(four), r5(five);
+  std::vector<std::string> shuffled(four.rbegin(), four.rend());
+  hash_ring r4b(shuffled);
+
+  printf("test10: lock ids spread over 4 and then 5 servers\n");
+  int n = 100000, moved = 0;
+  int count[5] = {0};
+  for (lock_protocol::lockid_t lid = 0; lid < (lock_protocol::lockid_t) n; lid++) {
+    int s4 = r4.route(lid), s5 = r5.route(lid);
+    if (r4b.route(lid) != 3 - s4) {
+      fprintf(stderr, "error: server order changed the owner of %016llx\n", lid);
+      exit(1);
+    }
+    count[s5]++;
+    if (s4 != s5) {
+      moved++;
+      if (s5 != 4) {
+        fprintf(stderr, "error: %016llx moved between old servers\n", lid);
+        exit(1);
+      }
+    }
+  }
+  printf("test10: %d %d %d %d %d ids per server, %d%% moved\n", count[0],
+         count[1], count[2], count[3], count[4], moved * 100 / n);
+  for (int i = 0; i < 5; i++) {
+    if (count[i] < n / 5 / 2 || count[i] > n / 5 * 2) {
+      fprintf(stderr, "error: server %d owns %d of %d ids\n", i, count[i], n);
+      exit(1);
+    }
+  }
+  if (moved > n * 2 / 5) {
+    fprintf(stderr, "error: adding a server moved %d of %d ids\n", moved, n);
+    exit(1);
+  }
+}
+
+// test11: threads of one client that contend for a lock queue for it
+// inside the client, so the server sees a single acquire however many
+// times they take it.
+void *
+test11(void *x)
+{
+  int i = * (int *) x;
+  lock_protocol::lockid_t e = 5;
+
+  printf ("test11: thread %d acquire e release e concurrent; same clnt\n", i);
+  for (int j = 0; j < 10; j++) {
+    lc[0]->acquire(e);
+    check_grant(e);
+    check_release(e);
+    lc[0]->release(e);
+  }
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -164,15 +408,15 @@ main(int argc, char *argv[])
 
     if (argc > 2) {
       test = atoi(argv[2]);
-      if(test < 1 || test > 5){
-        printf("Test number must be between 1 and 5\n");
+      if(test < 1 || test > 11){
+        printf("Test number must be between 1 and 11\n");
         exit(1);
       }
     }
 
     VERIFY(pthread_mutex_init(&count_mutex, NULL) == 0);
     printf("lock client\n");
-    for (int i = 0; i < nt; i++) lc[i] = new lock_client(dst);
+    for (int i = 0; i < nt; i++) lc[i] = new lock_client_cache(dst);
 
     if(!test || test == 1){
       test1();
@@ -233,6 +477,78 @@ main(int argc, char *argv[])
       }
     }
 
+    if(!test || test == 6){
+      printf("test 6\n");
+
+      // test 6
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test6, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    if(!test || test == 7){
+      printf("test 7\n");
+
+      // test 7
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test7, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    if(!test || test == 8){
+      printf("test 8\n");
+
+      // test 8
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test8, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+    }
+
+    // waits out a lease, so only on request
+    if(test == 9){
+      test9();
+    }
+
+    if(!test || test == 10){
+      test10();
+    }
+
+    if(!test || test == 11){
+      printf("test 11\n");
+
+      // test 11
+      for (int i = 0; i < nt; i++) {
+	int *a = new int (i);
+	r = pthread_create(&th[i], NULL, test11, (void *) a);
+	VERIFY (r == 0);
+      }
+      for (int i = 0; i < nt; i++) {
+	pthread_join(th[i], NULL);
+      }
+      int n = lc[0]->stat(5);
+      printf("test11: %d acquires of e reached the server\n", n);
+      if (n != 1) {
+        fprintf(stderr, "error: %d threads of one client sent %d acquires\n", nt, n);
+        fprintf(stdout, "error: %d threads of one client sent %d acquires\n", nt, n);
+        exit(1);
+      }
+    }
+
     printf ("%s: passed all tests successfully\n", argv[0]);
 
 }
\ No newline at end of file
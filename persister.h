@@ -18,7 +18,7 @@ class action {
 public:
     int type;
     action(int type0) : type(type0) {}
-    ~action() {};
+    virtual ~action() {};
     virtual void perform(extent_server *es) = 0;
 };
 
@@ -27,7 +27,7 @@ public:
     uint32_t type;
     create_action(uint32_t type0) :
         action(0), type(type0) {}
-    ~create_action();
+    ~create_action() {}
 
     void perform(extent_server *es) {
         extent_protocol::extentid_t id;
@@ -43,11 +43,47 @@ public:
         action(1), eid(eid0), buf(buf0) {
             //传递string不能用string.c_str()+len的形式，会出错。但是why?
         }
-    ~put_action();
+    ~put_action() {}
 
     void perform(extent_server *es) {
-        int r;
-        es->put(eid, buf, false, r);
+        extent_protocol::attr a;
+        es->put(eid, buf, false, a);
+    }
+};
+
+class write_range_action : public action {
+public:
+    extent_protocol::extentid_t eid;
+    unsigned long long off;
+    std::string buf;
+    write_range_action(extent_protocol::extentid_t eid0, unsigned long long off0,
+                       std::string buf0) :
+        action(3), eid(eid0), off(off0), buf(buf0) {}
+    ~write_range_action() {}
+
+    void perform(extent_server *es) {
+        extent_protocol::attr a;
+        es->write_range(eid, off, buf, false, a);
+    }
+};
+
+class tx_action : public action {
+public:
+    std::vector<extent_protocol::tx_op> ops;
+    tx_action(const std::vector<extent_protocol::tx_op> &ops0) :
+        action(4), ops(ops0) {}
+    ~tx_action() {}
+
+    void perform(extent_server *es) {
+        extent_protocol::tx_result res;
+        es->exec_tx(ops, false, res);
+    }
+
+    // kind, eid, type, off, patch_at, patch_new, target, data size, data
+    static uint64_t op_size(const extent_protocol::tx_op &o) {
+        return sizeof(int) + sizeof(extent_protocol::extentid_t) + sizeof(uint32_t)
+            + sizeof(unsigned long long) + 2 * sizeof(int)
+            + sizeof(extent_protocol::extentid_t) + sizeof(size_t) + o.data.size();
     }
 };
 
@@ -56,7 +92,7 @@ public:
     extent_protocol::extentid_t eid;
     remove_action(extent_protocol::extentid_t eid0) :
         action(2), eid(eid0) {}
-    ~remove_action();
+    ~remove_action() {}
 
     void perform(extent_server *es) {
         int r;
@@ -87,7 +123,9 @@ public:
         CMD_ABORT,
         CMD_CREATE,
         CMD_PUT,
-        CMD_REMOVE
+        CMD_REMOVE,
+        CMD_WRITE_RANGE,
+        CMD_TX            // a whole exec_tx; needs no BEGIN/COMMIT
     };
 
     cmd_type type = CMD_BEGIN;
@@ -118,6 +156,14 @@ public:
         } else if (type == CMD_PUT) {
             s += sizeof(extent_protocol::extentid_t) + sizeof(size_t)
                 + ((act::put_action *)redo_act)->buf.size();
+        } else if (type == CMD_WRITE_RANGE) {
+            s += sizeof(extent_protocol::extentid_t) + sizeof(unsigned long long)
+                + sizeof(size_t) + ((act::write_range_action *)redo_act)->buf.size();
+        } else if (type == CMD_TX) {
+            const std::vector<extent_protocol::tx_op> &ops = ((act::tx_action *)redo_act)->ops;
+            s += sizeof(size_t);
+            for (size_t i = 0; i < ops.size(); i++)
+                s += act::tx_action::op_size(ops[i]);
         }
         return s;
     }
@@ -165,6 +211,35 @@ public:
             // // std::cout << "string: " << ((act::put_action *)undo_act)->buf << std::endl;
             // memcpy(log+offset, ((act::put_action *)undo_act)->buf.c_str(), ((act::put_action *)undo_act)->buf.size());
             // offset += ((act::put_action *)undo_act)->buf.size();
+        } else if (type == CMD_WRITE_RANGE) {
+            act::write_range_action *w = (act::write_range_action *)redo_act;
+            *(extent_protocol::extentid_t *)(log+offset) = w->eid;
+            offset += sizeof(extent_protocol::extentid_t);
+            *(unsigned long long *)(log+offset) = w->off;
+            offset += sizeof(unsigned long long);
+            *(size_t *)(log+offset) = w->buf.size();
+            offset += sizeof(size_t);
+            memcpy(log+offset, w->buf.data(), w->buf.size());
+            offset += w->buf.size();
+        } else if (type == CMD_TX) {
+            const std::vector<extent_protocol::tx_op> &ops = ((act::tx_action *)redo_act)->ops;
+            *(size_t *)(log+offset) = ops.size(); offset += sizeof(size_t);
+            for (size_t i = 0; i < ops.size(); i++) {
+                const extent_protocol::tx_op &o = ops[i];
+                *(int *)(log+offset) = o.kind; offset += sizeof(int);
+                *(extent_protocol::extentid_t *)(log+offset) = o.eid;
+                offset += sizeof(extent_protocol::extentid_t);
+                *(uint32_t *)(log+offset) = o.type; offset += sizeof(uint32_t);
+                *(unsigned long long *)(log+offset) = o.off;
+                offset += sizeof(unsigned long long);
+                *(int *)(log+offset) = o.patch_at; offset += sizeof(int);
+                *(int *)(log+offset) = o.patch_new; offset += sizeof(int);
+                *(extent_protocol::extentid_t *)(log+offset) = o.target;
+                offset += sizeof(extent_protocol::extentid_t);
+                *(size_t *)(log+offset) = o.data.size(); offset += sizeof(size_t);
+                memcpy(log+offset, o.data.data(), o.data.size());
+                offset += o.data.size();
+            }
         }
 
         std::string ret_str(log, size());
@@ -236,7 +311,8 @@ persister<command>::~persister() {
 template<typename command>
 void persister<command>::append_log(const command& log) {
     
-    
+    std::lock_guard<std::mutex> l(mtx);
+
     //open和write必须要在同一个函数中，但是why？
     std::ofstream outFile(file_path_logfile, std::ios::binary | std::ios::app);
     // std::cout << file_path_logfile << std::endl;
@@ -256,6 +332,8 @@ void persister<command>::append_log(const command& log) {
 template<typename command>
 void persister<command>::checkpoint(inode_manager *im) {
 
+    std::lock_guard<std::mutex> l(mtx);
+
     im->save_current_disk(file_path_checkpoint);
 
     //如果在二者中间crash怎么办？会出错吧？
@@ -357,6 +435,45 @@ void persister<command>::restore_logdata(extent_server *es, chfs_command::txid_t
             //     log_entries.back().undo_act = new act::put_action(eid, std::string(""));
             //     // std::cout << "empty string222" << std::endl;
             // }
+        } else if (ty == chfs_command::CMD_WRITE_RANGE) {
+            extent_protocol::extentid_t eid;
+            unsigned long long off;
+            size_t len;
+
+            inFile.read((char *)&eid, sizeof(extent_protocol::extentid_t));
+            inFile.read((char *)&off, sizeof(unsigned long long));
+            inFile.read((char *)&len, sizeof(size_t));
+            std::string buf(len, '\0');
+            if (len)
+                inFile.read(&buf[0], len);
+            log_entries.back().redo_act = new act::write_range_action(eid, off, buf);
+        } else if (ty == chfs_command::CMD_TX) {
+            size_t n = 0;
+            inFile.read((char *)&n, sizeof(size_t));
+            std::vector<extent_protocol::tx_op> ops(inFile ? n : 0);
+            for (size_t i = 0; i < ops.size() && inFile; i++) {
+                extent_protocol::tx_op &o = ops[i];
+                size_t len = 0;
+                inFile.read((char *)&o.kind, sizeof(int));
+                inFile.read((char *)&o.eid, sizeof(extent_protocol::extentid_t));
+                inFile.read((char *)&o.type, sizeof(uint32_t));
+                inFile.read((char *)&o.off, sizeof(unsigned long long));
+                inFile.read((char *)&o.patch_at, sizeof(int));
+                inFile.read((char *)&o.patch_new, sizeof(int));
+                inFile.read((char *)&o.target, sizeof(extent_protocol::extentid_t));
+                inFile.read((char *)&len, sizeof(size_t));
+                if (!inFile)
+                    break;
+                o.data.assign(len, '\0');
+                if (len)
+                    inFile.read(&o.data[0], len);
+            }
+            // a record cut short by a crash was never applied; drop it
+            if (!inFile) {
+                log_entries.pop_back();
+                break;
+            }
+            log_entries.back().redo_act = new act::tx_action(ops);
         }
         // std::cout << std::endl;
     }
@@ -366,14 +483,22 @@ void persister<command>::restore_logdata(extent_server *es, chfs_command::txid_t
     for (chfs_command cmd : log_entries) {
         if (cmd.type == chfs_command::CMD_COMMIT) {
             commit_set.insert(cmd.id);
-        } else if (cmd.type == chfs_command::CMD_BEGIN) {
+        } else if (cmd.type == chfs_command::CMD_BEGIN ||
+                   cmd.type == chfs_command::CMD_TX) {
             txid = cmd.id > txid ? cmd.id : txid;
         }
     }
+    // every mutation is logged as a CMD_TX now; the single-op records
+    // are only found in logs that framed them with BEGIN and COMMIT
     for (chfs_command cmd : log_entries) {
+        if (cmd.type == chfs_command::CMD_TX) {
+            cmd.redo_act->perform(es);
+            continue;
+        }
         if ((cmd.type == chfs_command::CMD_CREATE ||
             cmd.type == chfs_command::CMD_PUT ||
-            cmd.type == chfs_command::CMD_REMOVE) &&
+            cmd.type == chfs_command::CMD_REMOVE ||
+            cmd.type == chfs_command::CMD_WRITE_RANGE) &&
             commit_set.count(cmd.id)) {
                 cmd.redo_act->perform(es);
             }
@@ -0,0 +1,29 @@
+#include "server_list.h"
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+std::vector<std::string>
+parse_server_list(const std::string &dst)
+{
+  std::vector<std::string> servers;
+  std::ifstream f(dst.c_str());
+  if (!f) {
+    servers.push_back(dst);
+    return servers;
+  }
+
+  std::string line;
+  while (std::getline(f, line)) {
+    size_t b = line.find_first_not_of(" \t\r");
+    if (b == std::string::npos || line[b] == '#')
+      continue;
+    size_t e = line.find_last_not_of(" \t\r");
+    servers.push_back(line.substr(b, e - b + 1));
+  }
+  if (servers.empty()) {
+    fprintf(stderr, "server list %s is empty\n", dst.c_str());
+    exit(1);
+  }
+  return servers;
+}
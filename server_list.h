@@ -0,0 +1,14 @@
+// where a client finds its servers
+
+#ifndef server_list_h
+#define server_list_h
+
+#include <string>
+#include <vector>
+
+// dst is either a single [host:]port or the path of a file with one
+// [host:]port per line, as start.sh writes for several lock servers.
+// Blank lines and lines starting with '#' are skipped.
+std::vector<std::string> parse_server_list(const std::string &dst);
+
+#endif
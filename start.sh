@@ -4,10 +4,14 @@ ulimit -c unlimited
 
 LOSSY=$1
 NUM_LS=$2
+NUM_ES=$3
 
 if [ -z $NUM_LS ]; then
     NUM_LS=0
 fi
+if [ -z $NUM_ES ]; then
+    NUM_ES=0
+fi
 
 BASE_PORT=$RANDOM
 BASE_PORT=$[BASE_PORT+2000]
@@ -29,9 +33,12 @@ fi
 if [ "$LOSSY" ]; then
     export RPC_LOSSY=$LOSSY
 fi
+LOCK_DST=$LOCK_PORT
 if [ $NUM_LS -gt 1 ]; then
+    # clients spread lock ids over the servers listed in config
+    LOCK_DST=$PWD/config
     x=0
-    rm config
+    rm -f config
     while [ $x -lt $NUM_LS ]; do
       port=$[LOCK_PORT+2*x]
       x=$[x+1]
@@ -54,24 +61,41 @@ unset RPC_LOSSY
 
 
 # =======start extent server=======
-echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
-./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
-sleep 1
+EXTENT_DST=$EXTENT_PORT
+if [ $NUM_ES -gt 1 ]; then
+    # each extent server holds one shard of the inodes; clients find
+    # them, in shard order, in extent_config
+    EXTENT_DST=$PWD/extent_config
+    x=0
+    rm -f extent_config
+    while [ $x -lt $NUM_ES ]; do
+      port=$[EXTENT_PORT+1000+2*x]
+      echo $port >> extent_config
+      echo "starting ./extent_server $port $x $NUM_ES > extent_server$x.log 2>&1 &"
+      ./extent_server $port $x $NUM_ES > extent_server$x.log 2>&1 &
+      x=$[x+1]
+    done
+    sleep 1
+else
+    echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
+    ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
+    sleep 1
+fi
 
 
 # =======start chfs client=======
 rm -rf $ChFSDIR1
 mkdir $ChFSDIR1 || exit 1
 sleep 1
-echo "starting ./chfs_client $ChFSDIR1 $EXTENT_PORT $LOCK_PORT > chfs_client1.log 2>&1 &"
-./chfs_client $ChFSDIR1 $EXTENT_PORT $LOCK_PORT > chfs_client1.log 2>&1 &
+echo "starting ./chfs_client $ChFSDIR1 $EXTENT_DST $LOCK_DST > chfs_client1.log 2>&1 &"
+./chfs_client $ChFSDIR1 $EXTENT_DST $LOCK_DST > chfs_client1.log 2>&1 &
 sleep 1
 
 rm -rf $ChFSDIR2
 mkdir $ChFSDIR2 || exit 1
 sleep 1
-echo "starting ./chfs_client $ChFSDIR2 $EXTENT_PORT $LOCK_PORT > chfs_client2.log 2>&1 &"
-./chfs_client $ChFSDIR2 $EXTENT_PORT $LOCK_PORT > chfs_client2.log 2>&1 &
+echo "starting ./chfs_client $ChFSDIR2 $EXTENT_DST $LOCK_DST > chfs_client2.log 2>&1 &"
+./chfs_client $ChFSDIR2 $EXTENT_DST $LOCK_DST > chfs_client2.log 2>&1 &
 sleep 2
 
 
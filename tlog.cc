@@ -0,0 +1,162 @@
+// ring-buffered logging, see tlog.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "tlog.h"
+
+namespace {
+
+const unsigned long RING_SLOTS = 1024;   // a power of two
+const int LINE_MAX_LEN = 256;
+
+// A bounded multi-producer multi-consumer queue. Slot i is free for
+// the enqueue at position pos when its seq is pos, and holds a line
+// for the dequeue at pos when its seq is pos + 1.
+struct slot {
+  std::atomic<unsigned long> seq;
+  int len;
+  char line[LINE_MAX_LEN];
+};
+
+struct ring {
+  slot slots[RING_SLOTS];
+  std::atomic<unsigned long> head, tail;
+  std::atomic<unsigned long> dropped;
+
+  ring() : head(0), tail(0), dropped(0) {
+    for (unsigned long i = 0; i < RING_SLOTS; i++)
+      slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  slot *claim(unsigned long &pos) {
+    pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+      slot *s = &slots[pos & (RING_SLOTS - 1)];
+      long dif = (long) s->seq.load(std::memory_order_acquire) - (long) pos;
+      if (dif == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          return s;
+      } else if (dif < 0) {
+        return NULL;   // full
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  slot *take(unsigned long &pos) {
+    pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      slot *s = &slots[pos & (RING_SLOTS - 1)];
+      long dif = (long) s->seq.load(std::memory_order_acquire) - (long) (pos + 1);
+      if (dif == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          return s;
+      } else if (dif < 0) {
+        return NULL;   // empty
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+ring r;
+std::once_flag started;
+// only one drain writes at a time, so lines keep their ring order
+std::mutex out_mtx;
+
+// Write out what is in the ring now; true if there was anything.
+bool
+drain()
+{
+  std::lock_guard<std::mutex> l(out_mtx);
+  char buf[64 * LINE_MAX_LEN];
+  size_t n = 0;
+  bool any = false;
+  unsigned long pos;
+  slot *s;
+  while ((s = r.take(pos)) != NULL) {
+    if (n + s->len > sizeof(buf)) {
+      fwrite(buf, 1, n, stdout);
+      n = 0;
+    }
+    memcpy(buf + n, s->line, s->len);
+    n += s->len;
+    s->seq.store(pos + RING_SLOTS, std::memory_order_release);
+    any = true;
+  }
+  if (n)
+    fwrite(buf, 1, n, stdout);
+  unsigned long d = r.dropped.exchange(0);
+  if (d)
+    fprintf(stdout, "tlog: dropped %lu lines\n", d);
+  if (n || d)
+    fflush(stdout);
+  return any;
+}
+
+void
+drainer()
+{
+  for (;;) {
+    if (!drain())
+      usleep(1000);
+  }
+}
+
+void
+start()
+{
+  std::thread(drainer).detach();
+  atexit(tlog_flush);
+}
+
+}
+
+void
+tlog_write(const char *fmt, ...)
+{
+  std::call_once(started, start);
+
+  unsigned long pos;
+  slot *s = r.claim(pos);
+  if (s == NULL) {
+    r.dropped++;
+    return;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  int n = snprintf(s->line, LINE_MAX_LEN, "%ld:\t",
+                   tv.tv_sec * 1000 + tv.tv_usec / 1000);
+  va_list ap;
+  va_start(ap, fmt);
+  int m = vsnprintf(s->line + n, LINE_MAX_LEN - n, fmt, ap);
+  va_end(ap);
+  if (m < 0)
+    m = 0;
+  if (n + m >= LINE_MAX_LEN) {
+    // cut short; keep it a line of its own
+    n = LINE_MAX_LEN - 1;
+    s->line[n - 1] = '\n';
+  } else {
+    n += m;
+  }
+  s->len = n;
+  s->seq.store(pos + 1, std::memory_order_release);
+}
+
+void
+tlog_flush()
+{
+  drain();
+}
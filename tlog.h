@@ -0,0 +1,37 @@
+#ifndef tlog_h
+#define tlog_h
+
+// Leveled logging for hot paths.
+//
+// Levels are jsl_log's: JSL_DBG_1 critical, JSL_DBG_2 error, JSL_DBG_3
+// info, JSL_DBG_4 debugging. A call above LOG_LEVEL (a build flag, see
+// GNUmakefile) compiles to nothing, arguments included, so a debug line
+// that asks the file system something costs nothing when it is off.
+//
+// An enabled call formats its line, stamped like tprintf, into a
+// lock-free ring; a background thread writes the ring out in batches,
+// so the caller never makes a syscall. When the ring is full the line
+// is dropped and counted rather than making the caller wait.
+
+#include "jsl_log.h"
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL JSL_DBG_2
+#endif
+
+#define tlog(level, ...) do { \
+        if ((level) <= LOG_LEVEL) \
+            tlog_write(__VA_ARGS__); \
+    } while (0)
+
+#define tlog_crit(...)  tlog(JSL_DBG_1, __VA_ARGS__)
+#define tlog_err(...)   tlog(JSL_DBG_2, __VA_ARGS__)
+#define tlog_info(...)  tlog(JSL_DBG_3, __VA_ARGS__)
+#define tlog_debug(...) tlog(JSL_DBG_4, __VA_ARGS__)
+
+void tlog_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Write out everything logged so far. Also runs at exit.
+void tlog_flush();
+
+#endif
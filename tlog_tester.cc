@@ -0,0 +1,98 @@
+//
+// tlog tester: logs from several threads into a file standing in for
+// stdout and checks what comes out.
+//
+
+#include "tlog.h"
+#include "lang/verify.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+int nt = 8;
+int nlines = 20000;   // per thread, many more than the ring holds
+int evaluated;
+
+int
+side_effect()
+{
+  return ++evaluated;
+}
+
+void *
+writer(void *x)
+{
+  int i = * (int *) x;
+  for (int j = 0; j < nlines; j++)
+    tlog(LOG_LEVEL, "tlog_tester %d %d\n", i, j);
+  return 0;
+}
+
+void
+fail(const char *what)
+{
+  fprintf(stderr, "error: %s\n", what);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  char path[] = "/tmp/tlog_tester.XXXXXX";
+  int fd = mkstemp(path);
+  VERIFY(fd >= 0);
+  close(fd);
+  VERIFY(freopen(path, "w", stdout) != NULL);
+
+  // above LOG_LEVEL, a call and its arguments compile away
+  tlog(LOG_LEVEL + 1, "tlog_tester above %d\n", side_effect());
+  if (evaluated != 0)
+    fail("a call above LOG_LEVEL evaluated its arguments");
+
+  std::vector<pthread_t> th(nt);
+  std::vector<int> ids(nt);
+  for (int i = 0; i < nt; i++) {
+    ids[i] = i;
+    VERIFY(pthread_create(&th[i], NULL, writer, (void *) &ids[i]) == 0);
+  }
+  for (int i = 0; i < nt; i++)
+    pthread_join(th[i], NULL);
+  tlog_flush();
+
+  // each thread's lines come out whole and in order; a line that is
+  // missing was counted as dropped
+  std::ifstream in(path);
+  std::string line;
+  std::vector<int> last(nt, -1);
+  long seen = 0, dropped = 0;
+  while (std::getline(in, line)) {
+    int i, j;
+    unsigned long d;
+    const char *tab = strchr(line.c_str(), '\t');
+    if (sscanf(line.c_str(), "tlog: dropped %lu lines", &d) == 1) {
+      dropped += d;
+    } else if (tab == NULL ||
+               sscanf(tab + 1, "tlog_tester %d %d", &i, &j) != 2 ||
+               i < 0 || i >= nt) {
+      fail("a line came out torn or unstamped");
+    } else if (j <= last[i]) {
+      fail("a thread's lines came out of order");
+    } else {
+      last[i] = j;
+      seen++;
+    }
+  }
+  unlink(path);
+  fprintf(stderr, "%ld lines written, %ld dropped\n", seen, dropped);
+  if (seen + dropped != (long) nt * nlines)
+    fail("lines went missing without being counted");
+
+  fprintf(stderr, "%s: passed all tests successfully\n", argv[0]);
+}